@@ -0,0 +1,155 @@
+/*
+**  igmpproxy - IGMP proxy based multicast router
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+*   acl.c - Compiled group white- and blacklists.
+*
+*   The whitelist and blacklist entries of an interface are evaluated in
+*   order, and the last entry matching a group decides. If no entry
+*   matches, the group is allowed unless there is a whitelist. At load
+*   time the list is turned into sorted, disjoint address ranges that
+*   each carry the decision for all groups in them, so a group is looked
+*   up with a binary search.
+*/
+
+#include "igmpproxy.h"
+
+struct GroupAclRange {
+    uint32_t            first;          // First address, host order.
+    bool                allow;
+};
+
+struct GroupAcl {
+    unsigned            count;
+    struct GroupAclRange range[];       // Ordered, the first starts at 0.
+};
+
+static int compareAddr(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+*   Evaluates the list the slow way, for the group 'addr' in host order.
+*/
+static bool listAllows(struct SubnetList *list, uint32_t addr) {
+    struct SubnetList   *sn, *match = NULL;
+    bool                allow_list = false;
+    uint32_t            group = htonl(addr);
+
+    for (sn = list; sn != NULL; sn = sn->next) {
+        // Check if there is a whitelist
+        if (sn->allow)
+            allow_list = true;
+        if ((group & sn->subnet_mask) == sn->subnet_addr)
+            match = sn;
+    }
+
+    return match != NULL ? match->allow : !allow_list;
+}
+
+/**
+*   Compiles a white- and blacklist. Returns NULL if the list is empty,
+*   which allows every group.
+*/
+struct GroupAcl *compileGroupAcl(struct SubnetList *list) {
+    struct GroupAcl     *acl;
+    struct SubnetList   *sn;
+    uint32_t            *bounds, first, last;
+    unsigned            nbounds = 0, i;
+
+    if (list == NULL) {
+        return NULL;
+    }
+
+    // Every entry starts a range, and ends one unless it reaches the end
+    // of the address space.
+    for (sn = list; sn != NULL; sn = sn->next) {
+        nbounds += 2;
+    }
+    bounds = (uint32_t *)malloc((nbounds + 1) * sizeof(uint32_t));
+    if (bounds == NULL) {
+        my_log(LOG_ERR, 0, "Out of memory.");
+    }
+    nbounds = 0;
+    bounds[nbounds++] = 0;
+    for (sn = list; sn != NULL; sn = sn->next) {
+        first = ntohl(sn->subnet_addr & sn->subnet_mask);
+        last  = first | ~ntohl(sn->subnet_mask);
+        bounds[nbounds++] = first;
+        if (last != 0xFFFFFFFF) {
+            bounds[nbounds++] = last + 1;
+        }
+    }
+    qsort(bounds, nbounds, sizeof(uint32_t), compareAddr);
+
+    acl = (struct GroupAcl *)malloc(sizeof(struct GroupAcl) +
+        nbounds * sizeof(struct GroupAclRange));
+    if (acl == NULL) {
+        my_log(LOG_ERR, 0, "Out of memory.");
+    }
+
+    // No entry starts or ends inside a range, so its first address
+    // decides for all of it. Neighbours with the same decision are merged.
+    acl->count = 0;
+    for (i = 0; i < nbounds; i++) {
+        bool allow;
+
+        if (i > 0 && bounds[i] == bounds[i - 1]) {
+            continue;
+        }
+        allow = listAllows(list, bounds[i]);
+        if (acl->count > 0 && acl->range[acl->count - 1].allow == allow) {
+            continue;
+        }
+        acl->range[acl->count].first = bounds[i];
+        acl->range[acl->count].allow = allow;
+        acl->count++;
+    }
+    free(bounds);
+
+    my_log(LOG_DEBUG, 0, "Compiled group list to %u ranges.", acl->count);
+
+    return acl;
+}
+
+/**
+*   Returns true if 'group' passes the compiled list 'acl'.
+*/
+bool groupAclAllows(const struct GroupAcl *acl, uint32_t group) {
+    uint32_t    addr = ntohl(group);
+    unsigned    lo, hi, mid;
+
+    if (acl == NULL) {
+        return true;
+    }
+
+    // Find the last range starting at or before the address.
+    lo = 0;
+    hi = acl->count;
+    while (hi - lo > 1) {
+        mid = (lo + hi) / 2;
+        if (acl->range[mid].first <= addr) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return acl->range[lo].allow;
+}
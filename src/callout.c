@@ -15,255 +15,372 @@
 **  You should have received a copy of the GNU General Public License
 **  along with this program; if not, write to the Free Software
 **  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
-**
-**----------------------------------------------------------------------------
-**
-**  This software is derived work from the following software. The original
-**  source code has been modified from it's original state by the author
-**  of igmpproxy.
-**
-**  smcroute 0.92 - Copyright (C) 2001 Carsten Schill <carsten@cschill.de>
-**  - Licensed under the GNU General Public License, either version 2 or
-**    any later version.
-**
-**  mrouted 3.9-beta3 - Copyright (C) 2002 by The Board of Trustees of
-**  Leland Stanford Junior University.
-**  - Licensed under the 3-clause BSD license, see Stanford.txt file.
-**
 */
 
+/**
+*   callout.c - Timers, kept in a hierarchical timing wheel.
+*
+*   The wheel has WHEEL_LEVELS levels of WHEEL_SIZE slots. A timer is put
+*   on the lowest level whose range covers its remaining time, and timers
+*   of the higher levels are cascaded down when the lower level wraps. This
+*   makes setting and clearing a timer O(1), independent of the number of
+*   pending timers.
+*/
 
 #include "igmpproxy.h"
 
-/* the code below implements a callout queue */
-static int id = 0;
-static struct timeOutQueue  *queue = 0; /* pointer to the beginning of timeout queue */
+#define WHEEL_BITS      8
+#define WHEEL_SIZE      (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS    4
+
+// Links of the circular timer lists. Must be the first member of a timer.
+struct timerLink {
+    struct timerLink       *next;
+    struct timerLink       *prev;
+};
 
 struct timeOutQueue {
-    struct timeOutQueue    *next;   // Next event in queue
-    int                     id;
+    struct timerLink        link;   // Position in a wheel slot
+    struct timerLink        *slot;  // Slot of the timer, NULL once expired
+    unsigned long           id;     // Identifier, 0 when the timer is free
     timer_f                 func;   // function to call
     void                    *data;  // Data for function
-    int                     time;   // Time offset for next event
+    uint32_t                expires;// Absolute expiry time
 };
 
-// Method for dumping the Queue to the log.
-static void debugQueue(void);
+static struct timerLink     wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint32_t             occupied[WHEEL_LEVELS][WHEEL_SIZE / 32];
+static unsigned             pending;    // Number of timers in the wheel
+static uint32_t             now;        // Current time of the wheel
+static unsigned long        id = 0;
+static struct Pool          timer_pool;
+
+/**
+*   Functions for the timer lists and slots
+*/
+
+static inline void listInit(struct timerLink *head) {
+    head->next = head->prev = head;
+}
+
+static inline void listAppend(struct timerLink *head, struct timerLink *link) {
+    link->prev = head->prev;
+    link->next = head;
+    head->prev->next = link;
+    head->prev = link;
+}
+
+static inline void listUnlink(struct timerLink *link) {
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link->next = link->prev = link;
+}
+
+static inline void slotMark(int level, unsigned slot) {
+    occupied[level][slot / 32] |= 1u << (slot % 32);
+}
+
+static inline void slotUpdate(struct timerLink *head) {
+    unsigned level = (head - &wheel[0][0]) / WHEEL_SIZE;
+    unsigned slot = (head - &wheel[0][0]) % WHEEL_SIZE;
+
+    if (head->next == head) {
+        occupied[level][slot / 32] &= ~(1u << (slot % 32));
+    }
+}
+
+/**
+*   Returns the index of the first occupied slot on the level, starting
+*   from 'start' and wrapping around. Returns -1 if the level is empty.
+*/
+static int slotNext(int level, unsigned start) {
+    unsigned i, word, bits;
+
+    for (i = 0; i <= WHEEL_SIZE / 32; i++) {
+        word = ((start / 32) + i) % (WHEEL_SIZE / 32);
+        bits = occupied[level][word];
+        if (i == 0) {
+            bits &= ~0u << (start % 32);
+        } else if (i == WHEEL_SIZE / 32) {
+            bits &= ~(~0u << (start % 32));
+        }
+        if (bits) {
+            return word * 32 + ffs(bits) - 1;
+        }
+    }
+    return -1;
+}
+
+/**
+*   Puts the timer on the right level and slot for its expiry time.
+*/
+static void wheelInsert(struct timeOutQueue *node) {
+    uint32_t    left = node->expires - now;
+    int         level;
+    unsigned    slot;
+
+    if ((int32_t)left < 0) {
+        // Already expired, fire on the next run.
+        node->expires = now;
+        left = 0;
+    }
+    for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+        if (left < 1u << (WHEEL_BITS * (level + 1))) {
+            break;
+        }
+    }
+    slot = (node->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+    node->slot = &wheel[level][slot];
+    listAppend(node->slot, &node->link);
+    slotMark(level, slot);
+}
+
+/**
+*   Moves the timers of a slot on a higher level to the lower levels.
+*/
+static void wheelCascade(int level) {
+    struct timerLink    *head = &wheel[level][(now >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    struct timerLink    *link;
+
+    while ((link = head->next) != head) {
+        listUnlink(link);
+        wheelInsert((struct timeOutQueue *)link);
+    }
+    slotUpdate(head);
+}
+
+/**
+*   Moves the timers of the current slot of the lowest level to
+*   the expired list.
+*/
+static void wheelCollect(struct timerLink *expired) {
+    struct timerLink    *head = &wheel[0][now & WHEEL_MASK];
+    struct timerLink    *link;
+
+    while ((link = head->next) != head) {
+        listUnlink(link);
+        listAppend(expired, link);
+        ((struct timeOutQueue *)link)->slot = NULL;
+        pending--;
+    }
+    slotUpdate(head);
+}
 
 /**
 *   Initializes the callout queue
 */
 void callout_init(void) {
-    queue = NULL;
+    int level, slot;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        for (slot = 0; slot < WHEEL_SIZE; slot++) {
+            listInit(&wheel[level][slot]);
+        }
+    }
+    memset(occupied, 0, sizeof(occupied));
+    pending = 0;
+    now = 0;
+    poolInit(&timer_pool, "timer", sizeof(struct timeOutQueue));
 }
 
 /**
 *   Clears all scheduled timeouts...
 */
 void free_all_callouts(void) {
-    struct timeOutQueue *p;
-
-    while (queue) {
-        p = queue;
-        queue = queue->next;
-        free(p);
+    struct timerLink    *head, *link;
+    int                 level, slot;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        for (slot = 0; slot < WHEEL_SIZE; slot++) {
+            head = &wheel[level][slot];
+            while ((link = head->next) != head) {
+                listUnlink(link);
+                ((struct timeOutQueue *)link)->id = 0;
+                poolFree(&timer_pool, link);
+            }
+        }
     }
+    memset(occupied, 0, sizeof(occupied));
+    pending = 0;
 }
 
 
 /**
- * elapsed_time seconds have passed; perform all the events that should
+ * elapsed_time milliseconds have passed; perform all the events that should
  * happen.
  */
 void age_callout_queue(int elapsed_time) {
+    struct timerLink    expired, *link;
     struct timeOutQueue *ptr;
-    struct timeOutQueue *_queue = NULL;
-    struct timeOutQueue *last = NULL;
-    int i = 0;
-
-    for (ptr = queue; ptr; ptr = ptr->next) {
-        if (ptr->time > elapsed_time) {
-            ptr->time -= elapsed_time;
-            break;
-        } else {
-            elapsed_time -= ptr->time;
-            if (_queue == NULL)
-                _queue = ptr;
-            last = ptr;
-         }
-    }
-
-    queue = ptr;
-    if (last) {
-        last->next = NULL;
+    uint32_t            left = elapsed_time > 0 ? elapsed_time : 0;
+    uint32_t            step;
+    timer_f             func;
+    void                *data;
+    int                 next, level, i = 0;
+
+    listInit(&expired);
+
+    // Timers set with no delay expire right away.
+    wheelCollect(&expired);
+
+    while (left > 0 && pending > 0) {
+        // Skip ahead to the next occupied slot or the end of the lowest level.
+        next = slotNext(0, (now & WHEEL_MASK) + 1 < WHEEL_SIZE ? (now & WHEEL_MASK) + 1 : 0);
+        step = WHEEL_SIZE - (now & WHEEL_MASK);
+        if (next > (int)(now & WHEEL_MASK) && (uint32_t)next - (now & WHEEL_MASK) < step) {
+            step = next - (now & WHEEL_MASK);
+        }
+        if (step > left) {
+            step = left;
+        }
+        now += step;
+        left -= step;
+
+        // On wrap around, cascade the timers of the higher levels.
+        if ((now & WHEEL_MASK) == 0) {
+            for (level = 1; level < WHEEL_LEVELS; level++) {
+                if ((now >> (WHEEL_BITS * level)) & WHEEL_MASK) {
+                    break;
+                }
+            }
+            if (level == WHEEL_LEVELS) {
+                level--;
+            }
+            for (; level > 0; level--) {
+                wheelCascade(level);
+            }
+        }
+        wheelCollect(&expired);
     }
+    now += left;
 
     /* process existing events */
-    for (ptr = _queue; ptr; ptr = _queue, i++) {
-        _queue = _queue->next;
-        my_log(LOG_DEBUG, 0, "About to call timeout %d (#%d)", ptr->id, i);
-        if (ptr->func)
-             ptr->func(ptr->data);
-        free(ptr);
+    while ((link = expired.next) != &expired) {
+        ptr = (struct timeOutQueue *)link;
+        listUnlink(link);
+        my_log(LOG_DEBUG, 0, "About to call timeout %lu (#%d)", ptr->id, i++);
+
+        // Release the timer before the call, it may set new timers.
+        func = ptr->func;
+        data = ptr->data;
+        ptr->id = 0;
+        poolFree(&timer_pool, ptr);
+
+        if (func)
+             func(data);
     }
 }
 
 /**
- * Return in how many seconds age_callout_queue() would like to be called.
+ * Return in how many milliseconds age_callout_queue() would like to be called.
  * Return -1 if there are no events pending.
  */
 int timer_nextTimer(void) {
-    if (queue) {
-        if (queue->time < 0) {
-            my_log(LOG_WARNING, 0, "timer_nextTimer top of queue says %d", 
-                queue->time);
-            return 0;
+    struct timerLink    *head, *link;
+    uint32_t            left, best = (uint32_t)-1;
+    unsigned            cur;
+    int                 level, slot[2], i;
+
+    if (pending == 0) {
+        return -1;
+    }
+
+    // The first occupied slot of each level holds the earliest timers of
+    // that level, but a lower level may still expire later than a higher one.
+    // Above the lowest level, the current slot only holds timers that wrapped
+    // around, almost a turn ahead, so the search starts after it, and the
+    // current slot is checked on its own.
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        cur = (now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        if (level == 0) {
+            slot[0] = slotNext(level, cur);
+            slot[1] = -1;
+        } else {
+            slot[0] = slotNext(level, (cur + 1) & WHEEL_MASK);
+            slot[1] = slot[0] != (int)cur && wheel[level][cur].next != &wheel[level][cur] ?
+                (int)cur : -1;
+        }
+        for (i = 0; i < 2; i++) {
+            if (slot[i] < 0) {
+                continue;
+            }
+            head = &wheel[level][slot[i]];
+            for (link = head->next; link != head; link = link->next) {
+                left = ((struct timeOutQueue *)link)->expires - now;
+                if (left < best) {
+                    best = left;
+                }
+            }
         }
-        return queue->time;
     }
-    return -1;
+
+    return best > INT_MAX ? INT_MAX : (int)best;
 }
 
 /**
  *  Inserts a timer in queue.
- *  @param delay - Number of seconds the timeout should happen in.
+ *  @param delay - Number of milliseconds the timeout should happen in.
  *  @param action - The function to call on timeout.
  *  @param data - Pointer to the function data to supply...
  */
-int timer_setTimer(int delay, timer_f action, void *data) {
-    struct timeOutQueue  *ptr, *node, *prev;
-    int i = 0;
+timer_h timer_setTimer(int delay, timer_f action, void *data) {
+    struct timeOutQueue  *node;
+    timer_h              handle = { NULL, 0 };
 
     /* create a node */
-    node = (struct timeOutQueue *)malloc(sizeof(struct timeOutQueue));
+    node = (struct timeOutQueue *)poolAlloc(&timer_pool);
     if (node == 0) {
         my_log(LOG_WARNING, 0, "Malloc Failed in timer_settimer\n");
-        return -1;
+        return handle;
     }
     node->func = action;
     node->data = data;
-    node->time = delay;
-    node->next = 0;
+    node->expires = now + (delay > 0 ? delay : 0);
     node->id   = ++id;
 
-    prev = ptr = queue;
-
-    /* insert node in the queue */
+    wheelInsert(node);
+    pending++;
 
-    /* if the queue is empty, insert the node and return */
-    if (!queue) {
-        queue = node;
-    }
-    else {
-        /* chase the pointer looking for the right place */
-        while (ptr) {
-            if (delay < ptr->time) {
-                // We found the correct node
-                node->next = ptr;
-                if (ptr == queue) {
-                    queue = node;
-                }
-                else {
-                    prev->next = node;
-                }
-                ptr->time -= node->time;
-                my_log(LOG_DEBUG, 0,
-                    "Created timeout %d (#%d) - delay %d secs",
-                    node->id, i, node->time);
-                debugQueue();
-                return node->id;
-            } else {
-                // Continur to check nodes.
-                delay -= ptr->time; node->time = delay;
-                prev = ptr;
-                ptr = ptr->next;
-            }
-            i++;
-        }
-        prev->next = node;
-    }
-    my_log(LOG_DEBUG, 0, "Created timeout %d (#%d) - delay %d secs",
-            node->id, i, node->time);
-    debugQueue();
+    my_log(LOG_DEBUG, 0, "Created timeout %lu - delay %d ms", node->id, delay);
 
-    return node->id;
+    handle.node = node;
+    handle.id = node->id;
+    return handle;
 }
 
 /**
 *   returns the time until the timer is scheduled
 */
-int timer_leftTimer(int timer_id) {
-    struct timeOutQueue *ptr;
-    int left = 0;
+int timer_leftTimer(timer_h timer) {
+    int32_t left;
 
-    if (!timer_id)
+    if (!timer.node || timer.node->id != timer.id)
         return -1;
 
-    for (ptr = queue; ptr; ptr = ptr->next) {
-        left += ptr->time;
-        if (ptr->id == timer_id) {
-            return left;
-        }
-    }
-    return -1;
+    left = timer.node->expires - now;
+    return left > 0 ? left : 0;
 }
 
 /**
 *   clears the associated timer.  Returns 1 if succeeded.
 */
-int timer_clearTimer(int  timer_id) {
-    struct timeOutQueue  *ptr, *prev;
-    int i = 0;
-
-    if (!timer_id)
+int timer_clearTimer(timer_h timer) {
+    if (!timer.node || timer.node->id != timer.id) {
+        // The timer has already expired, or was cleared before.
         return 0;
-
-    prev = ptr = queue;
-
-    /*
-     * find the right node, delete it. the subsequent node's time
-     * gets bumped up
-     */
-
-    debugQueue();
-    while (ptr) {
-        if (ptr->id == timer_id) {
-            /* got the right node */
-
-            /* unlink it from the queue */
-            if (ptr == queue)
-                queue = queue->next;
-            else
-                prev->next = ptr->next;
-
-            /* increment next node if any */
-            if (ptr->next != 0)
-                (ptr->next)->time += ptr->time;
-
-            if (ptr->data)
-                free(ptr->data);
-            my_log(LOG_DEBUG, 0, "deleted timer %d (#%d)", ptr->id, i);
-            free(ptr);
-            debugQueue();
-            return 1;
-        }
-        prev = ptr;
-        ptr = ptr->next;
-        i++;
     }
-    // If we get here, the timer was not deleted.
-    my_log(LOG_DEBUG, 0, "failed to delete timer %d (#%d)", timer_id, i);
-    debugQueue();
-    return 0;
-}
-
-/**
- * debugging utility
- */
-static void debugQueue(void) {
-    struct timeOutQueue  *ptr;
 
-    for (ptr = queue; ptr; ptr = ptr->next) {
-        my_log(LOG_DEBUG, 0, "(Id:%d, Time:%d) ", ptr->id, ptr->time);
+    // Unlink it from its slot, or from the list of expired timers.
+    listUnlink(&timer.node->link);
+    if (timer.node->slot) {
+        slotUpdate(timer.node->slot);
+        pending--;
     }
+
+    my_log(LOG_DEBUG, 0, "deleted timer %lu", timer.id);
+    timer.node->id = 0;
+    poolFree(&timer_pool, timer.node);
+    return 1;
 }
@@ -0,0 +1,104 @@
+/*
+**  igmpproxy - IGMP proxy based multicast router
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+*   callout_test.c - Checks that timer_nextTimer() finds the earliest
+*   timer of the wheel, also when timers wrap around a level.
+*/
+
+#include "igmpproxy.h"
+
+#define TEST_TIMERS     64
+
+void my_log(int severity, int errnum, const char *fmt, ...) {
+    (void)errnum;
+    (void)fmt;
+    if (severity <= LOG_ERR) {
+        exit(2);
+    }
+}
+
+void statsLine(FILE *fp, const char *fmt, ...) {
+    (void)fp;
+    (void)fmt;
+}
+
+static void noop(void *arg) {
+    (void)arg;
+}
+
+static int failed;
+
+static void expect(const char *what, int got, int want) {
+    if (got != want) {
+        fprintf(stderr, "%s: next timer in %d, expected %d\n", what, got, want);
+        failed = 1;
+    }
+}
+
+int main(void) {
+    timer_h     timers[TEST_TIMERS], dummy;
+    int         left[TEST_TIMERS];
+    int         i, round, step, best;
+
+    callout_init();
+
+    // A timer almost a turn of the second level ahead shares its slot
+    // with the current time, and must not hide an earlier timer.
+    dummy = timer_setTimer(1000, noop, NULL);
+    age_callout_queue(0x10);
+    timer_clearTimer(dummy);
+    timers[0] = timer_setTimer(65525, noop, NULL);
+    timers[1] = timer_setTimer(320, noop, NULL);
+    expect("wrapped slot", timer_nextTimer(), 320);
+    timer_clearTimer(timers[0]);
+    timer_clearTimer(timers[1]);
+    expect("empty wheel", timer_nextTimer(), -1);
+
+    // Compare with the earliest of random timers while the time advances.
+    srand(1);
+    for (i = 0; i < TEST_TIMERS; i++) {
+        timers[i] = timer_setTimer(rand() % 0x1000000, noop, NULL);
+    }
+    for (round = 0; round < 10000; round++) {
+        step = rand() % 3 ? rand() % 300 : rand() % 70000;
+        best = -1;
+        for (i = 0; i < TEST_TIMERS; i++) {
+            left[i] = timer_leftTimer(timers[i]);
+            if (left[i] >= 0 && left[i] < step) {
+                step = left[i];
+            }
+        }
+        age_callout_queue(step);
+        for (i = 0; i < TEST_TIMERS; i++) {
+            if ((left[i] = timer_leftTimer(timers[i])) < 0) {
+                timers[i] = timer_setTimer(rand() % 0x1000000, noop, NULL);
+                left[i] = timer_leftTimer(timers[i]);
+            }
+            if (best < 0 || left[i] < best) {
+                best = left[i];
+            }
+        }
+        expect("random timers", timer_nextTimer(), best);
+        if (failed) {
+            break;
+        }
+    }
+
+    return failed;
+}
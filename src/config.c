@@ -48,8 +48,9 @@ struct vifconfig {
     // Keep allowed nets for VIF.
     struct SubnetList*  allowednets;
 
-    // Allowed Groups
+    // Allowed Groups, and the compiled list.
     struct SubnetList*  allowedgroups;
+    struct GroupAcl*    groupAcl;
 
     // Next config in list...
     struct vifconfig*   next;
@@ -71,22 +72,47 @@ struct SubnetList *parseSubnetAddress(char *addrstr);
 static void initCommonConfig(void) {
     commonConfig.robustnessValue = DEFAULT_ROBUSTNESS;
     commonConfig.queryInterval = INTERVAL_QUERY;
-    commonConfig.queryResponseInterval = INTERVAL_QUERY_RESPONSE;
+    commonConfig.queryResponseInterval = INTERVAL_QUERY_RESPONSE * 1000;
 
     // The defaults are calculated from other settings.
     commonConfig.startupQueryInterval = (unsigned int)(INTERVAL_QUERY / 4);
     commonConfig.startupQueryCount = DEFAULT_ROBUSTNESS;
 
     // Default values for leave intervals...
-    commonConfig.lastMemberQueryInterval = INTERVAL_QUERY_RESPONSE;
+    commonConfig.lastMemberQueryInterval = INTERVAL_QUERY_RESPONSE * 1000;
     commonConfig.lastMemberQueryCount    = DEFAULT_ROBUSTNESS;
 
+    // Packets read from the IGMP socket at once, and per loop round.
+    commonConfig.recvBatch = 32;
+    commonConfig.recvBudget = 256;
+
+    // MFC entries are written with setsockopt by default.
+    commonConfig.mfcNetlink = 0;
+    commonConfig.proxyMfc = 0;
+
+    // Unwanted flows are reported again and again by default.
+    commonConfig.dropMfcLifetime = 0;
+    commonConfig.dropMfcSize = 1024;
+
+    // Origins stay until their group times out by default.
+    commonConfig.sourceIdle = 0;
+
+    // Traffic counters are not sampled by default.
+    commonConfig.statsInterval = 0;
+    commonConfig.statsFile[0] = '\0';
+
     // If 1, a leave message is sent upstream on leave messages from downstream.
     commonConfig.fastUpstreamLeave = 0;
 
-    // Default size of hash table is 32 bytes (= 256 bits) and can store
-    // up to the 256 non-collision hosts, approximately half of /24 subnet
-    commonConfig.downstreamHostsHashTableSize = 32;
+    // If 1, reports must come from an allowed net of the interface.
+    commonConfig.checkSubnets = 1;
+
+    // Upstream memberships are reported by the kernel by default.
+    commonConfig.upstreamReports = 0;
+
+    // Upstream membership changes are not paced by default.
+    commonConfig.upstreamRate = 0;
+    commonConfig.upstreamBurst = 32;
 
     // aimwang: default value
     commonConfig.defaultInterfaceState = IF_STATE_DISABLED;
@@ -100,6 +126,41 @@ struct Config *getCommonConfig(void) {
     return &commonConfig;
 }
 
+/**
+*   Parses a time interval into milliseconds. Plain numbers are in tenths
+*   of a second, like the IGMP max response time, and the suffixes "ms"
+*   and "s" select milliseconds and seconds. The interval must be within
+*   the range of the IGMP max response time, 0.1 to 25.5 seconds.
+*/
+static int parseInterval(const char *token, unsigned int *ms) {
+    unsigned long value;
+    char *end;
+
+    if(token == NULL) {
+        return 0;
+    }
+
+    value = strtoul(token, &end, 10);
+    if(end == token || value > 1000000) {
+        return 0;
+    }
+    if(strcmp(end, "ms") == 0) {
+        // Already in milliseconds
+    } else if(strcmp(end, "s") == 0) {
+        value *= 1000;
+    } else if(*end == '\0') {
+        value *= 100;
+    } else {
+        return 0;
+    }
+    if(value < 100 || value > 25500) {
+        return 0;
+    }
+
+    *ms = value;
+    return 1;
+}
+
 /**
 *   Loads the configuration from file, and stores the config in
 *   respective holders...
@@ -158,27 +219,282 @@ int loadConfig(char *configFile) {
             token = nextConfigToken();
             continue;
         }
+        else if(strcmp("nochecksubnets", token)==0) {
+            // Got a nochecksubnets token....
+            my_log(LOG_DEBUG, 0, "Config: Accepting reports from any source.");
+            commonConfig.checkSubnets = 0;
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("upstreamreports", token)==0) {
+            // Got a upstreamreports token....
+            my_log(LOG_DEBUG, 0, "Config: Sending the upstream reports.");
+            commonConfig.upstreamReports = 1;
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("upstreamrate", token)==0) {
+            // Got a upstreamrate token...
+            token = nextConfigToken();
+            my_log(LOG_DEBUG, 0, "Config: Upstream changes per second %s.", token);
+            int intToken = token ? atoi(token) : 0;
+            if(intToken < 1 || intToken > 100000) {
+                closeConfigFile();
+                my_log(LOG_ERR, 0, "Config: upstreamrate must be between 1 and 100000.");
+                return 0;
+            }
+            commonConfig.upstreamRate = intToken;
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("upstreamburst", token)==0) {
+            // Got a upstreamburst token...
+            token = nextConfigToken();
+            my_log(LOG_DEBUG, 0, "Config: Upstream change burst %s.", token);
+            int intToken = token ? atoi(token) : 0;
+            if(intToken < 1 || intToken > 65536) {
+                closeConfigFile();
+                my_log(LOG_ERR, 0, "Config: upstreamburst must be between 1 and 65536.");
+                return 0;
+            }
+            commonConfig.upstreamBurst = intToken;
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
         else if(strcmp("hashtablesize", token)==0) {
             // Got a hashtablesize token...
             token = nextConfigToken();
-            my_log(LOG_DEBUG, 0, "Config: hashtablesize for quickleave is %s.", token);
-            if(!commonConfig.fastUpstreamLeave) {
+            my_log(LOG_WARNING, 0, "Config: hashtablesize is obsolete, quickleave tracks the hosts exactly.");
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("queryresponseinterval", token)==0) {
+            // Got a queryresponseinterval token...
+            token = nextConfigToken();
+            my_log(LOG_DEBUG, 0, "Config: Query response interval is %s.", token);
+            if(!parseInterval(token, &commonConfig.queryResponseInterval)) {
+                closeConfigFile();
+                my_log(LOG_ERR, 0, "Config: queryresponseinterval must be between 100ms and 25500ms.");
+                return 0;
+            }
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("lastmemberqueryinterval", token)==0) {
+            // Got a lastmemberqueryinterval token...
+            token = nextConfigToken();
+            my_log(LOG_DEBUG, 0, "Config: Last member query interval is %s.", token);
+            if(!parseInterval(token, &commonConfig.lastMemberQueryInterval)) {
+                closeConfigFile();
+                my_log(LOG_ERR, 0, "Config: lastmemberqueryinterval must be between 100ms and 25500ms.");
+                return 0;
+            }
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("recvbatch", token)==0) {
+            // Got a recvbatch token...
+            token = nextConfigToken();
+            my_log(LOG_DEBUG, 0, "Config: Receive batch size is %s.", token);
+            int intToken = token ? atoi(token) : 0;
+            if(intToken < 1 || intToken > 256) {
+                closeConfigFile();
+                my_log(LOG_ERR, 0, "Config: recvbatch must be between 1 and 256.");
+                return 0;
+            }
+            commonConfig.recvBatch = intToken;
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("recvbudget", token)==0) {
+            // Got a recvbudget token...
+            token = nextConfigToken();
+            my_log(LOG_DEBUG, 0, "Config: Receive budget is %s.", token);
+            int intToken = token ? atoi(token) : 0;
+            if(intToken < 1 || intToken > 65536) {
+                closeConfigFile();
+                my_log(LOG_ERR, 0, "Config: recvbudget must be between 1 and 65536.");
+                return 0;
+            }
+            commonConfig.recvBudget = intToken;
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("mfcbackend", token)==0) {
+            // Got a mfcbackend token...
+            token = nextConfigToken();
+            my_log(LOG_DEBUG, 0, "Config: MFC backend is %s.", token);
+            if(token && strcmp("setsockopt", token)==0) {
+                commonConfig.mfcNetlink = 0;
+#ifdef HAVE_LINUX_RTNETLINK_H
+            } else if(token && strcmp("netlink", token)==0) {
+                commonConfig.mfcNetlink = 1;
+#endif
+            } else {
+                closeConfigFile();
+                my_log(LOG_ERR, 0, "Config: mfcbackend must be setsockopt or netlink (Linux only).");
+                return 0;
+            }
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("proxymfc", token)==0) {
+            // Got a proxymfc token...
+#ifdef MRT_ADD_MFC_PROXY
+            my_log(LOG_DEBUG, 0, "Config: (*,G) forwarding entries enabled.");
+            commonConfig.proxyMfc = 1;
+#else
+            closeConfigFile();
+            my_log(LOG_ERR, 0, "Config: proxymfc is not supported on this system.");
+            return 0;
+#endif
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("dropmfc", token)==0) {
+            // Got a dropmfc token...
+            token = nextConfigToken();
+            my_log(LOG_DEBUG, 0, "Config: Drop entry lifetime is %s.", token);
+            int intToken = token ? atoi(token) : 0;
+            if(intToken < 1 || intToken > 3600) {
                 closeConfigFile();
-                my_log(LOG_ERR, 0, "Config: hashtablesize is specified but quickleave not enabled.");
+                my_log(LOG_ERR, 0, "Config: dropmfc must be between 1 and 3600 seconds.");
                 return 0;
             }
-            int intToken = atoi(token);
-            if(intToken < 1 || intToken > 536870912) {
+            commonConfig.dropMfcLifetime = intToken;
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("dropmfcsize", token)==0) {
+            // Got a dropmfcsize token...
+            token = nextConfigToken();
+            my_log(LOG_DEBUG, 0, "Config: Drop cache size is %s.", token);
+            int intToken = token ? atoi(token) : 0;
+            if(intToken < 1 || intToken > 65536) {
                 closeConfigFile();
-                my_log(LOG_ERR, 0, "Config: hashtablesize must be between 1 and 536870912 bytes.");
+                my_log(LOG_ERR, 0, "Config: dropmfcsize must be between 1 and 65536.");
                 return 0;
             }
-            commonConfig.downstreamHostsHashTableSize = intToken;
+            commonConfig.dropMfcSize = intToken;
 
             // Read next token...
             token = nextConfigToken();
             continue;
         }
+        else if(strcmp("sourceidle", token)==0) {
+            // Got a sourceidle token...
+            token = nextConfigToken();
+            my_log(LOG_DEBUG, 0, "Config: Idle origins are removed after %s seconds.", token);
+            int intToken = token ? atoi(token) : 0;
+            if(intToken < 2 || intToken > 3600) {
+                closeConfigFile();
+                my_log(LOG_ERR, 0, "Config: sourceidle must be between 2 and 3600 seconds.");
+                return 0;
+            }
+            commonConfig.sourceIdle = intToken;
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("statsinterval", token)==0) {
+            // Got a statsinterval token...
+            token = nextConfigToken();
+            my_log(LOG_DEBUG, 0, "Config: Traffic counters are sampled every %s seconds.", token);
+            int intToken = token ? atoi(token) : 0;
+            if(intToken < 1 || intToken > 3600) {
+                closeConfigFile();
+                my_log(LOG_ERR, 0, "Config: statsinterval must be between 1 and 3600 seconds.");
+                return 0;
+            }
+            commonConfig.statsInterval = intToken;
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("statsfile", token)==0) {
+            // path is in next token
+            token = nextConfigToken();
+
+            if (snprintf(commonConfig.statsFile, sizeof(commonConfig.statsFile), "%s",
+              token) >= (int)sizeof(commonConfig.statsFile))
+                my_log(LOG_ERR, 0, "Config: statsfile is truncated");
+
+            my_log(LOG_DEBUG, 0, "Config: statsfile set to %s",
+              commonConfig.statsFile);
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("ssmmap", token)==0) {
+            // Got a ssmmap token, the group prefix and sources follow...
+            struct SubnetList   *sn = NULL;
+            struct in_addr      sources[MAX_SSM_SOURCES], addr;
+            int                 nsrcs = 0;
+
+            token = nextConfigToken();
+            if(token == NULL || (sn = parseSubnetAddress(token)) == NULL ||
+               !IN_MULTICAST(ntohl(sn->subnet_addr)) ||
+               (sn->subnet_addr & ~sn->subnet_mask) != 0) {
+                free(sn);
+                closeConfigFile();
+                my_log(LOG_ERR, 0, "Config: ssmmap needs a multicast group prefix.");
+                return 0;
+            }
+
+            // The sources end at the first token that is no address.
+            while((token = nextConfigToken()) != NULL && inet_aton(token, &addr) != 0) {
+                if(IN_MULTICAST(ntohl(addr.s_addr)) || addr.s_addr == INADDR_ANY) {
+                    free(sn);
+                    closeConfigFile();
+                    my_log(LOG_ERR, 0, "Config: ssmmap source %s is invalid.", inetFmt(addr.s_addr, s1));
+                    return 0;
+                }
+                if(nsrcs == MAX_SSM_SOURCES) {
+                    free(sn);
+                    closeConfigFile();
+                    my_log(LOG_ERR, 0, "Config: ssmmap takes at most %d sources.", MAX_SSM_SOURCES);
+                    return 0;
+                }
+                sources[nsrcs++] = addr;
+            }
+            if(nsrcs == 0) {
+                free(sn);
+                closeConfigFile();
+                my_log(LOG_ERR, 0, "Config: ssmmap needs at least one source.");
+                return 0;
+            }
+
+            my_log(LOG_DEBUG, 0, "Config: %s mapped to %d sources.",
+                inetFmts(sn->subnet_addr, sn->subnet_mask, s1), nsrcs);
+            addSsmMap(sn, nsrcs, sources);
+            free(sn);
+            continue;
+        }
         else if(strcmp("defaultdown", token)==0) {
             // Got a defaultdown token...
             my_log(LOG_DEBUG, 0, "Config: interface Default as down stream.");
@@ -231,9 +547,22 @@ int loadConfig(char *configFile) {
         token = getCurrentConfigToken();
     }
 
+    // Every write of the netlink backend needs CAP_NET_ADMIN, which is
+    // lost when the privileges are dropped.
+    if (commonConfig.mfcNetlink && commonConfig.user[0]) {
+        closeConfigFile();
+        my_log(LOG_ERR, 0, "Config: mfcbackend netlink cannot be used with user.");
+        return 0;
+    }
+
     // Close the configfile...
     closeConfigFile();
 
+    if(commonConfig.statsFile[0] && !commonConfig.statsInterval) {
+        my_log(LOG_ERR, 0, "Config: statsfile is specified but statsinterval is not.");
+        return 0;
+    }
+
     return 1;
 }
 
@@ -277,12 +606,19 @@ void configureVifs(void) {
                     vifLast->next = confPtr->allowednets;
 
                     Dp->allowedgroups = confPtr->allowedgroups;
+                    if(confPtr->allowedgroups != NULL && confPtr->groupAcl == NULL) {
+                        confPtr->groupAcl = compileGroupAcl(confPtr->allowedgroups);
+                    }
+                    Dp->groupAcl = confPtr->groupAcl;
 
                     break;
                 }
             }
         }
     }
+
+    // The allowed nets have changed.
+    indexIfVc();
 }
 
 
@@ -316,6 +652,7 @@ struct vifconfig *parsePhyintToken(void) {
     tmpPtr->state = commonConfig.defaultInterfaceState;
     tmpPtr->allowednets = NULL;
     tmpPtr->allowedgroups = NULL;
+    tmpPtr->groupAcl = NULL;
 
     // Make a copy of the token to store the IF name
     tmpPtr->name = strdup( token );
@@ -0,0 +1,214 @@
+/*
+**  igmpproxy - IGMP proxy based multicast router
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+*   dropcache.c - Drop entries for unwanted flows.
+*
+*   The kernel reports every (S,G) flow it has no MFC entry for. Flows
+*   that are not forwarded get an MFC entry without output VIFs instead,
+*   so the kernel drops them quietly until the entry expires. The cache
+*   is a ring in insertion order, which is also the expiry order, and
+*   the oldest entries are dropped first when it is full.
+*/
+
+#include "igmpproxy.h"
+
+struct DropEntry {
+    uint32_t            origin;
+    uint32_t            group;
+    short               inVif;          // Input VIF, or -1 if unused.
+    timer_h             timer;
+};
+
+// Ring of entries, and its hash index keyed by (S,G).
+static struct DropEntry     *drop_ring;
+static unsigned             drop_size, drop_head, drop_count, drop_live;
+static struct Hash          drop_hash;
+
+static unsigned long        drop_installs, drop_expired, drop_evicted, drop_forgotten;
+
+static inline uint32_t dropHashValue(uint32_t origin, uint32_t group) {
+    return hashMix(hashCombine(origin, group));
+}
+
+static uint32_t dropHashKey(const void *data) {
+    const struct DropEntry *entry = (const struct DropEntry *)data;
+
+    return dropHashValue(entry->origin, entry->group);
+}
+
+static struct DropEntry *dropHashFind(uint32_t origin, uint32_t group) {
+    struct DropEntry *entry;
+    unsigned slot;
+
+    for (slot = hashSlot(&drop_hash, dropHashValue(origin, group));
+         (entry = drop_hash.slots[slot]); slot = hashNext(&drop_hash, slot)) {
+        if (entry->origin == origin && entry->group == group) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+*   Removes the drop entry from the kernel.
+*/
+static void dropDelMRoute(struct DropEntry *entry) {
+    struct MRouteDesc mrDesc;
+
+    mrDesc.OriginAdr.s_addr = entry->origin;
+    mrDesc.McAdr.s_addr     = entry->group;
+    mrDesc.InVif            = entry->inVif;
+    memset(mrDesc.TtlVc, 0, sizeof(mrDesc.TtlVc));
+    delMRoute(&mrDesc);
+}
+
+/**
+*   Releases an entry, and removes it from the kernel if 'kernel' is set.
+*/
+static void dropRelease(struct DropEntry *entry, int kernel) {
+    hashRemove(&drop_hash, entry);
+    timer_clearTimer(entry->timer);
+    if (kernel) {
+        dropDelMRoute(entry);
+    }
+    entry->inVif = -1;
+    drop_live--;
+
+    // Released entries at the head of the ring can be reused.
+    while (drop_count > 0 && drop_ring[drop_head].inVif == -1) {
+        drop_head = (drop_head + 1) % drop_size;
+        drop_count--;
+    }
+}
+
+/**
+*   Timer callback, the lifetime of the entry has passed.
+*/
+static void dropExpire(void *data) {
+    struct DropEntry *entry = (struct DropEntry *)data;
+
+    my_log(LOG_DEBUG, 0, "Drop entry %s -> %s expired.",
+        inetFmt(entry->origin, s1), inetFmt(entry->group, s2));
+    drop_expired++;
+    dropRelease(entry, 1);
+}
+
+/**
+*   Initializes the drop cache, if enabled in the config.
+*/
+void initDropCache(void) {
+    struct Config *conf = getCommonConfig();
+
+    if (conf->dropMfcLifetime == 0) {
+        return;
+    }
+
+    // The index never has to grow, the ring holds at most half its size.
+    drop_size = conf->dropMfcSize;
+    hashInit(&drop_hash, "drop", drop_size * 2, dropHashKey);
+
+    drop_ring = (struct DropEntry *)calloc(drop_size, sizeof(struct DropEntry));
+    if (drop_ring == NULL) {
+        my_log(LOG_ERR, 0, "Out of memory.");
+    }
+    drop_head = drop_count = drop_live = 0;
+}
+
+/**
+*   Installs a drop entry for the flow from 'origin' to 'group' arriving
+*   on 'inVif', unless the flow is in the cache already.
+*/
+void dropCacheAdd(uint32_t origin, uint32_t group, int inVif) {
+    struct Config       *conf = getCommonConfig();
+    struct MRouteDesc   mrDesc;
+    struct DropEntry    *entry;
+
+    if (drop_ring == NULL || inVif < 0 || inVif >= MAXVIFS ||
+        dropHashFind(origin, group) != NULL) {
+        return;
+    }
+
+    // Make room by dropping the oldest entry.
+    if (drop_count == drop_size) {
+        drop_evicted++;
+        dropRelease(&drop_ring[drop_head], 1);
+    }
+
+    mrDesc.OriginAdr.s_addr = origin;
+    mrDesc.McAdr.s_addr     = group;
+    mrDesc.InVif            = inVif;
+    memset(mrDesc.TtlVc, 0, sizeof(mrDesc.TtlVc));
+    if (addMRoute(&mrDesc) != 0) {
+        return;
+    }
+    drop_installs++;
+
+    entry = &drop_ring[(drop_head + drop_count) % drop_size];
+    drop_count++;
+    drop_live++;
+    entry->origin = origin;
+    entry->group  = group;
+    entry->inVif  = inVif;
+    entry->timer  = timer_setTimer(conf->dropMfcLifetime * 1000, dropExpire, entry);
+
+    hashInsert(&drop_hash, entry);
+
+    my_log(LOG_DEBUG, 0, "Dropping %s -> %s on VIF %d for %us.",
+        inetFmt(origin, s1), inetFmt(group, s2), inVif, conf->dropMfcLifetime);
+}
+
+/**
+*   Forgets the drop entry of a flow, because the kernel entry is about to
+*   be written by the routing table.
+*/
+void dropCacheForget(uint32_t origin, uint32_t group) {
+    struct DropEntry *entry;
+
+    if (drop_ring == NULL || drop_live == 0) {
+        return;
+    }
+    if ((entry = dropHashFind(origin, group)) != NULL) {
+        drop_forgotten++;
+        dropRelease(entry, 0);
+    }
+}
+
+/**
+*   Removes all drop entries from the kernel.
+*/
+void clearDropCache(void) {
+    while (drop_ring != NULL && drop_count > 0) {
+        dropRelease(&drop_ring[drop_head], 1);
+    }
+}
+
+/**
+*   Writes the drop cache statistics to 'fp', or to the log if 'fp' is NULL.
+*/
+void dropCacheDumpStats(FILE *fp) {
+    if (drop_ring == NULL) {
+        return;
+    }
+    statsLine(fp, "dropcache.size %u", drop_size);
+    statsLine(fp, "dropcache.count %u", drop_live);
+    statsLine(fp, "dropcache.installs %lu", drop_installs);
+    statsLine(fp, "dropcache.expired %lu", drop_expired);
+    statsLine(fp, "dropcache.evicted %lu", drop_evicted);
+    statsLine(fp, "dropcache.forgotten %lu", drop_forgotten);
+}
@@ -0,0 +1,372 @@
+/*
+**  igmpproxy - IGMP proxy based multicast router
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+*   event.c - The main event loop.
+*
+*   Waits for input on the registered file descriptors, for signals and
+*   for the next timer of the callout queue. On Linux this is done with
+*   epoll, a timerfd armed with the deadline of the next timer, and a
+*   signalfd. Other systems use pselect().
+*/
+
+#include "igmpproxy.h"
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H) && defined(HAVE_SYS_SIGNALFD_H)
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#endif
+
+#define MAX_EVENT_FDS       16
+#define MAX_EVENT_SIGNALS   32
+#define MAX_EVENT_HOOKS     4
+
+struct EventSource {
+    int         fd;         // -1 if the slot is free
+    event_f     func;
+    void        *data;
+};
+
+static struct EventSource   sources[MAX_EVENT_FDS];
+static signal_f             sigfuncs[MAX_EVENT_SIGNALS];
+static void                 (*hooks[MAX_EVENT_HOOKS])(void);
+static sigset_t             sigmask;
+static bool                 stopped;
+
+// Start of the not yet accounted time of the callout queue.
+static struct timespec      lasttime;
+
+#ifdef USE_EPOLL
+static int                  epollFD = -1;
+static int                  timerFD = -1;
+static int                  signalFD = -1;
+static struct timespec      armed;      // Deadline the timerfd is armed with
+#else
+static volatile sig_atomic_t sigarrived[MAX_EVENT_SIGNALS];
+
+static void signalHandler(int sig) {
+    sigarrived[sig] = 1;
+}
+#endif
+
+/**
+*   Initializes the event loop.
+*/
+void initEvents(void) {
+    int i;
+
+    for (i = 0; i < MAX_EVENT_FDS; i++) {
+        sources[i].fd = -1;
+    }
+    sigemptyset(&sigmask);
+    stopped = false;
+
+#ifdef USE_EPOLL
+    struct epoll_event ev;
+
+    if ((epollFD = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        my_log(LOG_ERR, errno, "epoll_create1");
+
+    if ((timerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+        my_log(LOG_ERR, errno, "timerfd_create");
+    ev.events = EPOLLIN;
+    ev.data.ptr = &timerFD;
+    if (epoll_ctl(epollFD, EPOLL_CTL_ADD, timerFD, &ev) < 0)
+        my_log(LOG_ERR, errno, "epoll_ctl timerfd");
+    armed.tv_sec = armed.tv_nsec = 0;
+#endif
+}
+
+/**
+*   Registers a file descriptor. The function is called with the
+*   descriptor and data whenever the descriptor is readable.
+*   Returns 0 on success, and -1 if the descriptor can not be added.
+*/
+int event_addFd(int fd, event_f func, void *data) {
+    struct EventSource *src;
+
+    for (src = sources; src < VCEP(sources); src++) {
+        if (src->fd == -1) {
+            break;
+        }
+    }
+    if (src == VCEP(sources)) {
+        my_log(LOG_WARNING, 0, "Too many event sources, unable to add fd %d.", fd);
+        return -1;
+    }
+
+#ifdef USE_EPOLL
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = src;
+    if (epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        my_log(LOG_WARNING, errno, "epoll_ctl add fd %d", fd);
+        return -1;
+    }
+#endif
+
+    src->fd = fd;
+    src->func = func;
+    src->data = data;
+    return 0;
+}
+
+/**
+*   Unregisters a file descriptor.
+*/
+void event_delFd(int fd) {
+    struct EventSource *src;
+
+    for (src = sources; src < VCEP(sources); src++) {
+        if (src->fd == fd) {
+#ifdef USE_EPOLL
+            if (epoll_ctl(epollFD, EPOLL_CTL_DEL, fd, NULL) < 0)
+                my_log(LOG_WARNING, errno, "epoll_ctl del fd %d", fd);
+#endif
+            src->fd = -1;
+            return;
+        }
+    }
+}
+
+/**
+*   Registers a function to be called from the event loop when the
+*   signal is received.
+*/
+void event_addSignal(int sig, signal_f func) {
+    if (sig <= 0 || sig >= MAX_EVENT_SIGNALS) {
+        my_log(LOG_WARNING, 0, "Unable to handle signal %d.", sig);
+        return;
+    }
+    sigfuncs[sig] = func;
+    sigaddset(&sigmask, sig);
+
+    // The signal is only delivered through the event loop.
+    if (sigprocmask(SIG_BLOCK, &sigmask, NULL) < 0)
+        my_log(LOG_ERR, errno, "sigprocmask");
+
+#ifdef USE_EPOLL
+    struct epoll_event ev;
+    bool add = signalFD < 0;
+
+    if ((signalFD = signalfd(signalFD, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+        my_log(LOG_ERR, errno, "signalfd");
+    if (add) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = &signalFD;
+        if (epoll_ctl(epollFD, EPOLL_CTL_ADD, signalFD, &ev) < 0)
+            my_log(LOG_ERR, errno, "epoll_ctl signalfd");
+    }
+#else
+    struct sigaction sa;
+
+    sa.sa_handler = signalHandler;
+    sa.sa_flags = 0;
+    sigemptyset(&sa.sa_mask);
+    sigaction(sig, &sa, NULL);
+#endif
+}
+
+/**
+*   Registers a function to be called at the end of each round of the
+*   event loop, after the events and timers have been handled.
+*/
+void event_addHook(void (*func)(void)) {
+    int i;
+
+    for (i = 0; i < MAX_EVENT_HOOKS; i++) {
+        if (hooks[i] == NULL) {
+            hooks[i] = func;
+            return;
+        }
+    }
+    my_log(LOG_ERR, 0, "Too many event loop hooks.");
+}
+
+/**
+*   Makes the event loop return after the current round.
+*/
+void event_stop(void) {
+    stopped = true;
+}
+
+/**
+*   Accounts the time passed since the last round to the callout queue.
+*   Only whole milliseconds are accounted, the remainder is kept for the
+*   next round. 'msecs' is the time the last wait was set up for.
+*/
+static void ageTimers(int msecs) {
+    struct timespec curtime;
+    long long       elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &curtime);
+    elapsed = ((long long)(curtime.tv_sec - lasttime.tv_sec) * 1000000000 +
+               (curtime.tv_nsec - lasttime.tv_nsec)) / 1000000;
+    if (elapsed > 0 || msecs == 0) {
+        lasttime.tv_sec += elapsed / 1000;
+        lasttime.tv_nsec += (elapsed % 1000) * 1000000;
+        if (lasttime.tv_nsec >= 1000000000) {
+            lasttime.tv_sec++;
+            lasttime.tv_nsec -= 1000000000;
+        }
+        age_callout_queue(elapsed > INT_MAX ? INT_MAX : (int)elapsed);
+    }
+}
+
+#ifdef USE_EPOLL
+/**
+*   Arms the timerfd with the deadline of the next timer, or disarms
+*   it if no timer is pending. Does nothing if the deadline is unchanged.
+*/
+static void armTimer(int msecs) {
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    if (msecs >= 0) {
+        its.it_value.tv_sec = lasttime.tv_sec + msecs / 1000;
+        its.it_value.tv_nsec = lasttime.tv_nsec + (msecs % 1000) * 1000000;
+        if (its.it_value.tv_nsec >= 1000000000) {
+            its.it_value.tv_sec++;
+            its.it_value.tv_nsec -= 1000000000;
+        }
+    }
+    if (its.it_value.tv_sec == armed.tv_sec && its.it_value.tv_nsec == armed.tv_nsec) {
+        return;
+    }
+
+    if (timerfd_settime(timerFD, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        my_log(LOG_WARNING, errno, "timerfd_settime");
+    armed = its.it_value;
+}
+
+/**
+*   Waits for and dispatches one round of events.
+*/
+static void waitEvents(int msecs) {
+    struct epoll_event  events[MAX_EVENT_FDS + 2];
+    struct EventSource  *src;
+    int                 n, i;
+
+    armTimer(msecs);
+
+    n = epoll_wait(epollFD, events, VCMC(events), -1);
+    if (n < 0) {
+        if (errno != EINTR) my_log(LOG_WARNING, errno, "epoll_wait() failure");
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (events[i].data.ptr == &timerFD) {
+            uint64_t expirations;
+
+            if (read(timerFD, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                my_log(LOG_WARNING, errno, "read timerfd");
+            // The timer has fired, it is rearmed on the next round.
+            armed.tv_sec = armed.tv_nsec = 0;
+        } else if (events[i].data.ptr == &signalFD) {
+            struct signalfd_siginfo si;
+
+            while (read(signalFD, &si, sizeof(si)) == sizeof(si)) {
+                if (si.ssi_signo < MAX_EVENT_SIGNALS && sigfuncs[si.ssi_signo])
+                    sigfuncs[si.ssi_signo](si.ssi_signo);
+            }
+        } else {
+            src = events[i].data.ptr;
+            if (src->fd >= 0)
+                src->func(src->fd, src->data);
+        }
+    }
+}
+#else
+/**
+*   Waits for and dispatches one round of events.
+*/
+static void waitEvents(int msecs) {
+    struct EventSource  *src;
+    struct timespec     tv, *timeout = NULL;
+    sigset_t            waitmask;
+    fd_set              ReadFDS;
+    int                 MaxFD = -1, Rt, sig;
+
+    if (msecs >= 0) {
+        tv.tv_sec = msecs / 1000;
+        tv.tv_nsec = (msecs % 1000) * 1000000;
+        timeout = &tv;
+    }
+
+    FD_ZERO(&ReadFDS);
+    for (src = sources; src < VCEP(sources); src++) {
+        if (src->fd >= 0) {
+            FD_SET(src->fd, &ReadFDS);
+            if (src->fd > MaxFD)
+                MaxFD = src->fd;
+        }
+    }
+
+    // Signals are only unblocked while waiting.
+    sigprocmask(SIG_BLOCK, NULL, &waitmask);
+    for (sig = 1; sig < MAX_EVENT_SIGNALS; sig++) {
+        if (sigfuncs[sig])
+            sigdelset(&waitmask, sig);
+    }
+
+    Rt = pselect(MaxFD + 1, &ReadFDS, NULL, NULL, timeout, &waitmask);
+
+    for (sig = 1; sig < MAX_EVENT_SIGNALS; sig++) {
+        if (sigarrived[sig]) {
+            sigarrived[sig] = 0;
+            sigfuncs[sig](sig);
+        }
+    }
+
+    if (Rt < 0) {
+        if (errno != EINTR) my_log(LOG_WARNING, errno, "select() failure");
+        return;
+    }
+
+    for (src = sources; Rt > 0 && src < VCEP(sources); src++) {
+        if (src->fd >= 0 && FD_ISSET(src->fd, &ReadFDS)) {
+            src->func(src->fd, src->data);
+        }
+    }
+}
+#endif
+
+/**
+*   Runs the event loop until event_stop() is called.
+*/
+void event_loop(void) {
+    int msecs, i;
+
+    clock_gettime(CLOCK_MONOTONIC, &lasttime);
+
+    while (!stopped) {
+        msecs = timer_nextTimer();
+        waitEvents(msecs);
+        if (stopped)
+            break;
+        ageTimers(msecs);
+
+        for (i = 0; i < MAX_EVENT_HOOKS && hooks[i]; i++) {
+            hooks[i]();
+        }
+    }
+}
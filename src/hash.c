@@ -0,0 +1,127 @@
+/*
+**  igmpproxy - IGMP proxy based multicast router
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+*   hash.c - Open addressing hash indexes.
+*
+*   An index keeps pointers to entries in a table of a power of two slots,
+*   with linear probing. The load is kept below 1/2 by doubling the table,
+*   and a removal shifts back the following entries of its probe sequence,
+*   so that lookups never have to skip over deleted slots. The owner of the
+*   index tells the hash value of the key of an entry, and compares the
+*   keys itself while it walks a probe sequence with hashSlot() and
+*   hashNext().
+*/
+
+#include "igmpproxy.h"
+
+/**
+*   Moves the entries of the index to a new table of 'size' slots.
+*/
+static void hashResize(struct Hash *hash, unsigned size) {
+    void **old_slots = hash->slots;
+    unsigned old_size = hash->size;
+    unsigned i, slot;
+
+    hash->slots = (void **)calloc(size, sizeof(void *));
+    if (hash->slots == NULL) {
+        my_log(LOG_ERR, 0, "Out of memory.");
+    }
+    hash->size = size;
+
+    for (i = 0; i < old_size; i++) {
+        if (old_slots[i] == NULL) {
+            continue;
+        }
+        for (slot = hashSlot(hash, hash->func(old_slots[i])); hash->slots[slot];
+             slot = hashNext(hash, slot));
+        hash->slots[slot] = old_slots[i];
+    }
+    free(old_slots);
+
+    my_log(LOG_DEBUG, 0, "Hash index %s resized to %u slots.", hash->name, size);
+}
+
+/**
+*   Initializes an empty index of at least 'size' slots, which is
+*   rounded up to a power of two. 'func' returns the hash value of the
+*   key of an entry. An index initialized before is emptied.
+*/
+void hashInit(struct Hash *hash, const char *name, unsigned size, hash_f func) {
+    unsigned slots;
+
+    for (slots = 1; slots < size; slots <<= 1);
+
+    free(hash->slots);
+    hash->slots = NULL;
+    hash->size  = 0;
+    hash->count = 0;
+    hash->func  = func;
+    hash->name  = name;
+    hashResize(hash, slots);
+}
+
+/**
+*   Adds an entry to the index, which grows when it gets half full.
+*/
+void hashInsert(struct Hash *hash, void *entry) {
+    unsigned slot;
+
+    if ((hash->count + 1) * 2 > hash->size) {
+        hashResize(hash, hash->size * 2);
+    }
+    for (slot = hashSlot(hash, hash->func(entry)); hash->slots[slot];
+         slot = hashNext(hash, slot));
+    hash->slots[slot] = entry;
+    hash->count++;
+}
+
+/**
+*   Removes an entry from the index, if it is there.
+*/
+void hashRemove(struct Hash *hash, void *entry) {
+    unsigned mask = hash->size - 1;
+    unsigned slot, next, home;
+
+    for (slot = hashSlot(hash, hash->func(entry)); hash->slots[slot] != entry;
+         slot = hashNext(hash, slot)) {
+        if (hash->slots[slot] == NULL) {
+            return;
+        }
+    }
+
+    // Shift back the following entries of the probe sequence that may
+    // not be placed before the freed slot.
+    for (next = hashNext(hash, slot); hash->slots[next]; next = hashNext(hash, next)) {
+        home = hashSlot(hash, hash->func(hash->slots[next]));
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            hash->slots[slot] = hash->slots[next];
+            slot = next;
+        }
+    }
+    hash->slots[slot] = NULL;
+    hash->count--;
+}
+
+/**
+*   Removes all entries from the index, and keeps its size.
+*/
+void hashClear(struct Hash *hash) {
+    memset(hash->slots, 0, hash->size * sizeof(void *));
+    hash->count = 0;
+}
@@ -0,0 +1,165 @@
+/*
+**  igmpproxy - IGMP proxy based multicast router
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+*   hosts.c - Downstream hosts of the groups, for quickleave.
+*
+*   Every (group, VIF, host) seen in a membership report is kept once in
+*   a hash index shared by all groups. The hosts of a group are also
+*   linked from the route, with counts per VIF, so that the routing table
+*   can tell at once whether a group or a VIF of it has any hosts left.
+*/
+
+#include "igmpproxy.h"
+
+struct HostEntry {
+    struct HostEntry    *next;          // Next host of the group.
+    struct HostEntry    **pprev;        // Link pointing to this host.
+    uint32_t            group;
+    uint32_t            host;
+    int                 vif;
+};
+
+// Hash index of all hosts, keyed by group, VIF and host.
+#define HOST_HASH_MINSIZE   64
+static struct Hash          host_hash;
+
+static struct Pool          host_pool;
+
+static inline uint32_t hostHashValue(uint32_t group, int vif, uint32_t host) {
+    return hashMix(hashCombine(hashCombine(host, group), (uint32_t)vif));
+}
+
+static uint32_t hostHashKey(const void *data) {
+    const struct HostEntry *entry = (const struct HostEntry *)data;
+
+    return hostHashValue(entry->group, entry->vif, entry->host);
+}
+
+static struct HostEntry *hostHashFind(uint32_t group, int vif, uint32_t host) {
+    struct HostEntry *entry;
+    unsigned slot;
+
+    for (slot = hashSlot(&host_hash, hostHashValue(group, vif, host));
+         (entry = host_hash.slots[slot]); slot = hashNext(&host_hash, slot)) {
+        if (entry->group == group && entry->vif == vif && entry->host == host) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+*   Unlinks and releases a host of the set.
+*/
+static void hostRelease(struct HostSet *set, struct HostEntry *entry) {
+    hashRemove(&host_hash, entry);
+    *entry->pprev = entry->next;
+    if (entry->next) {
+        entry->next->pprev = entry->pprev;
+    }
+    set->count--;
+    set->vifCount[entry->vif]--;
+    poolFree(&host_pool, entry);
+}
+
+/**
+*   Initializes the host tracking.
+*/
+void initHosts(void) {
+    poolInit(&host_pool, "host", sizeof(struct HostEntry));
+    hashInit(&host_hash, "host", HOST_HASH_MINSIZE, hostHashKey);
+}
+
+/**
+*   Clears the host set of a new route.
+*/
+void hostSetInit(struct HostSet *set) {
+    memset(set, 0, sizeof(*set));
+}
+
+/**
+*   Records 'host' as a member of 'group' on 'vif'. Returns 1 if the host
+*   was not known yet.
+*/
+int hostAdd(struct HostSet *set, uint32_t group, int vif, uint32_t host) {
+    struct HostEntry *entry;
+
+    if (vif < 0 || vif >= MAXVIFS || hostHashFind(group, vif, host) != NULL) {
+        return 0;
+    }
+
+    entry = (struct HostEntry *)poolAlloc(&host_pool);
+    if (entry == NULL) {
+        my_log(LOG_WARNING, 0, "Out of memory. Host %s not tracked.", inetFmt(host, s1));
+        return 0;
+    }
+    entry->group = group;
+    entry->host  = host;
+    entry->vif   = vif;
+
+    hashInsert(&host_hash, entry);
+
+    entry->next  = set->list;
+    entry->pprev = &set->list;
+    if (set->list) {
+        set->list->pprev = &entry->next;
+    }
+    set->list = entry;
+    set->count++;
+    set->vifCount[vif]++;
+
+    return 1;
+}
+
+/**
+*   Removes 'host' from the members of 'group' on 'vif'. Returns 1 if the
+*   host was known.
+*/
+int hostDel(struct HostSet *set, uint32_t group, int vif, uint32_t host) {
+    struct HostEntry *entry;
+
+    if (vif < 0 || vif >= MAXVIFS || (entry = hostHashFind(group, vif, host)) == NULL) {
+        return 0;
+    }
+    hostRelease(set, entry);
+    return 1;
+}
+
+/**
+*   Removes the hosts of the set on 'vif'.
+*/
+void hostClearVif(struct HostSet *set, int vif) {
+    struct HostEntry *entry, *next;
+
+    for (entry = set->list; entry && set->vifCount[vif] > 0; entry = next) {
+        next = entry->next;
+        if (entry->vif == vif) {
+            hostRelease(set, entry);
+        }
+    }
+}
+
+/**
+*   Removes all hosts of the set.
+*/
+void hostClear(struct HostSet *set) {
+    while (set->list) {
+        hostRelease(set, set->list);
+    }
+}
@@ -43,6 +43,249 @@ static inline uint32_t s_addr_from_sockaddr(const struct sockaddr *addr) {
 
 struct IfDesc IfDescVc[ MAX_IF ], *IfDescEp = IfDescVc;
 
+// Maps kernel interface indexes to the IfDesc of the interface.
+static struct IfDesc **IfIndexMap = NULL;
+static int IfIndexMapSize = 0;
+
+#if MAX_IF > 64
+#error "The net index keeps the interfaces in a 64 bit set."
+#endif
+
+// Binary trie over the allowed nets of all interfaces. Each node holds
+// the interface with the most specific net covering it, and the set of
+// interfaces with any net covering it, so one walk answers both.
+struct IfNetNode {
+    unsigned            child[2];       // Node indexes, 0 if none.
+    short               owner;          // IfDescVc index, or -1.
+    uint64_t            ifBits;         // IfDescVc indexes covering the node.
+};
+
+static struct IfNetNode *IfNetTrie = NULL;
+static unsigned IfNetTrieSize = 0, IfNetTrieCount = 0;
+
+/*
+** Returns the trie node for the net 'addr'/'len', addr in host order.
+*/
+static struct IfNetNode *addIfNetNode(uint32_t addr, int len) {
+    unsigned n = 0, bit;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        bit = (addr >> (31 - i)) & 1;
+        if (IfNetTrie[n].child[bit] == 0) {
+            if (IfNetTrieCount == IfNetTrieSize) {
+                struct IfNetNode *trie;
+
+                trie = realloc(IfNetTrie, 2 * IfNetTrieSize * sizeof(*trie));
+                if (trie == NULL)
+                    my_log(LOG_ERR, 0, "Out of memory !");
+                IfNetTrie = trie;
+                IfNetTrieSize *= 2;
+            }
+            memset(&IfNetTrie[IfNetTrieCount], 0, sizeof(*IfNetTrie));
+            IfNetTrie[IfNetTrieCount].owner = -1;
+            IfNetTrie[n].child[bit] = IfNetTrieCount++;
+        }
+        n = IfNetTrie[n].child[bit];
+    }
+    return &IfNetTrie[n];
+}
+
+/*
+** Rebuilds the net index from the allowed nets of the interface vector.
+*/
+static void indexIfNets(void) {
+    struct IfDesc *Dp;
+    struct SubnetList *sn;
+    struct IfNetNode *node;
+    unsigned n, i;
+
+    if (IfNetTrie == NULL) {
+        IfNetTrieSize = 64;
+        IfNetTrie = malloc(IfNetTrieSize * sizeof(*IfNetTrie));
+        if (IfNetTrie == NULL)
+            my_log(LOG_ERR, 0, "Out of memory !");
+    }
+    memset(IfNetTrie, 0, sizeof(*IfNetTrie));
+    IfNetTrie[0].owner = -1;
+    IfNetTrieCount = 1;
+
+    for (Dp = IfDescVc; Dp < IfDescEp; Dp++) {
+        for (sn = Dp->allowednets; sn != NULL; sn = sn->next) {
+            uint32_t mask = ntohl(sn->subnet_mask);
+            int len = 0;
+
+            while (len < 32 && (mask & (0x80000000u >> len)))
+                len++;
+            node = addIfNetNode(ntohl(sn->subnet_addr) & mask, len);
+            node->ifBits |= (uint64_t)1 << (Dp - IfDescVc);
+
+            // The first interface with the net owns it. A default net
+            // covers addresses, but does not make them belong anywhere.
+            if (len > 0 && node->owner < 0)
+                node->owner = Dp - IfDescVc;
+        }
+    }
+
+    // Children are always added after their parent, so one pass in order
+    // hands every node down what its ancestors hold.
+    for (n = 0; n < IfNetTrieCount; n++) {
+        for (i = 0; i < 2; i++) {
+            if (IfNetTrie[n].child[i] == 0)
+                continue;
+            node = &IfNetTrie[IfNetTrie[n].child[i]];
+            node->ifBits |= IfNetTrie[n].ifBits;
+            if (node->owner < 0)
+                node->owner = IfNetTrie[n].owner;
+        }
+    }
+}
+
+/*
+** Rebuilds the ifindex map and the net index from the interface vector.
+** An interface with several entries (aliases) is mapped to the first
+** with an address.
+*/
+void indexIfVc(void) {
+    struct IfDesc *Dp;
+    int size;
+
+    indexIfNets();
+
+    memset(IfIndexMap, 0, IfIndexMapSize * sizeof(*IfIndexMap));
+    for (Dp = IfDescVc; Dp < IfDescEp; Dp++) {
+        if (!Dp->InAdr.s_addr || Dp->ifIndex <= 0)
+            continue;
+
+        if (Dp->ifIndex >= IfIndexMapSize) {
+            struct IfDesc **map;
+
+            for (size = IfIndexMapSize ? IfIndexMapSize : 16; size <= Dp->ifIndex; size *= 2)
+                ;
+            map = realloc(IfIndexMap, size * sizeof(*map));
+            if (map == NULL)
+                my_log(LOG_ERR, 0, "Out of memory !");
+            memset(map + IfIndexMapSize, 0, (size - IfIndexMapSize) * sizeof(*map));
+            IfIndexMap = map;
+            IfIndexMapSize = size;
+        }
+        if (IfIndexMap[Dp->ifIndex] == NULL)
+            IfIndexMap[Dp->ifIndex] = Dp;
+    }
+}
+
+/*
+** Updates the IfDesc of the interface 'name' with address 'addr', and
+** adds it if it is new. A downstream interface that was lost or hidden
+** gets its VIF back.
+*/
+static void updateIfDesc(int Sock, const char *name, uint32_t addr) {
+    struct Config *config = getCommonConfig();
+    struct IfDesc *Dp;
+    struct ifreq IfReq;
+    uint32_t subnet, mask;
+    char FmtBu[ 32 ];
+
+    for (Dp = IfDescVc; Dp < IfDescEp; Dp++) {
+        if (0 == strcmp(Dp->Name, name)) {
+            break;
+        }
+    }
+
+    if (Dp == IfDescEp) {
+        if (IfDescEp == VCEP(IfDescVc)) {
+            my_log(LOG_WARNING, 0, "Too many interfaces, ignoring %s.", name);
+            return;
+        }
+        strncpy( Dp->Name, name, sizeof( IfDescEp->Name ) - 1 );
+        Dp->Name[ sizeof( IfDescEp->Name ) - 1 ] = '\0';
+    }
+
+    // Get the interface adress...
+    Dp->InAdr.s_addr = addr;
+
+    memcpy( IfReq.ifr_name, Dp->Name, sizeof( IfReq.ifr_name ) );
+
+    if (ioctl(Sock, SIOCGIFINDEX, &IfReq ) < 0)
+        my_log(LOG_ERR, errno, "ioctl SIOCGIFINDEX for %s", IfReq.ifr_name);
+    Dp->ifIndex = IfReq.ifr_ifindex;
+
+    // Get the subnet mask...
+    if (ioctl(Sock, SIOCGIFNETMASK, &IfReq ) < 0)
+        my_log(LOG_ERR, errno, "ioctl SIOCGIFNETMASK for %s", IfReq.ifr_name);
+    mask = s_addr_from_sockaddr(&IfReq.ifr_addr); // Do not use ifr_netmask as it is not available on freebsd
+    subnet = addr & mask;
+
+    if ( ioctl( Sock, SIOCGIFFLAGS, &IfReq ) < 0 )
+        my_log( LOG_ERR, errno, "ioctl SIOCGIFFLAGS" );
+    Dp->Flags = IfReq.ifr_flags;
+
+    if (0x10d1 == Dp->Flags)
+    {
+        if ( ioctl( Sock, SIOCGIFDSTADDR, &IfReq ) < 0 )
+            my_log(LOG_ERR, errno, "ioctl SIOCGIFDSTADDR for %s", IfReq.ifr_name);
+        addr = s_addr_from_sockaddr(&IfReq.ifr_dstaddr);
+        subnet = addr & mask;
+    }
+
+    if (Dp == IfDescEp) {
+        // Insert the verified subnet as an allowed net...
+        Dp->allowednets = (struct SubnetList *)malloc(sizeof(struct SubnetList));
+        if(IfDescEp->allowednets == NULL) {
+            my_log(LOG_ERR, 0, "Out of memory !");
+        }
+        Dp->allowednets->next = NULL;
+        Dp->state         = IF_STATE_DOWNSTREAM;
+        Dp->robustness    = DEFAULT_ROBUSTNESS;
+        Dp->threshold     = DEFAULT_THRESHOLD;   /* ttl limit */
+        Dp->ratelimit     = DEFAULT_RATELIMIT;
+    }
+
+    // Set the network address for the IF..
+    Dp->allowednets->subnet_mask = mask;
+    Dp->allowednets->subnet_addr = subnet;
+
+    // Set the state for the IF...
+    if (Dp->state == IF_STATE_LOST) {
+        Dp->state         = IF_STATE_DOWNSTREAM;
+    }
+
+    // when IF become enabeld from downstream, addVIF to enable its VIF
+    if (Dp->state == IF_STATE_HIDDEN) {
+        my_log(LOG_NOTICE, 0, "%s [Hidden -> Downstream]", Dp->Name);
+        Dp->state = IF_STATE_DOWNSTREAM;
+        addVIF(Dp);
+        k_join(Dp, allrouters_group);
+    }
+
+    // addVIF when found new IF
+    if (Dp == IfDescEp) {
+        my_log(LOG_NOTICE, 0, "%s [New]", Dp->Name);
+        Dp->state = config->defaultInterfaceState;
+        addVIF(Dp);
+        k_join(Dp, allrouters_group);
+        IfDescEp++;
+    }
+
+    // Debug log the result...
+    my_log( LOG_DEBUG, 0, "rebuildIfVc: Interface %s Index: %d Addr: %s, Flags: 0x%04x, Network: %s",
+        Dp->Name,
+        Dp->ifIndex,
+        fmtInAdr( FmtBu, Dp->InAdr ),
+        Dp->Flags,
+        inetFmts(subnet, mask, s1));
+}
+
+/*
+** Hides a downstream interface that is gone, and removes its VIF.
+*/
+static void hideIfDesc(struct IfDesc *Dp) {
+    my_log(LOG_NOTICE, 0, "%s [Downstream -> Hidden]", Dp->Name);
+    Dp->state = IF_STATE_HIDDEN;
+    k_leave(Dp, allrouters_group);
+    delVIF(Dp);
+}
+
 /* aimwang: add for detect interface and rebuild IfVc record */
 /***************************************************
  * TODO:    Only need run me when detect downstream changed.
@@ -55,12 +298,8 @@ void rebuildIfVc () {
     struct ifconf IoCtlReq;
     struct IfDesc *Dp;
     struct ifreq  *IfPt, *IfNext;
-    uint32_t addr, subnet, mask;
     int Sock;
 
-    // Get the config.
-    struct Config *config = getCommonConfig();
-
     if ( (Sock = socket( AF_INET, SOCK_DGRAM, 0 )) < 0 )
         my_log( LOG_ERR, errno, "RAW socket open" );
 
@@ -80,9 +319,6 @@ void rebuildIfVc () {
     IfEp = (void *)((char *)IfVc + IoCtlReq.ifc_len);
 
     for ( IfPt = IfVc; IfPt < IfEp; IfPt = IfNext ) {
-        struct ifreq IfReq;
-        char FmtBu[ 32 ];
-
         IfNext = (struct ifreq *)((char *)&IfPt->ifr_addr +
 #ifdef HAVE_STRUCT_SOCKADDR_SA_LEN
                 IfPt->ifr_addr.sa_len
@@ -93,112 +329,202 @@ void rebuildIfVc () {
         if (IfNext < IfPt + 1)
             IfNext = IfPt + 1;
 
-        for (Dp = IfDescVc; Dp < IfDescEp; Dp++) {
-            if (0 == strcmp(Dp->Name, IfPt->ifr_name)) {
-                break;
-            }
-        }
-
-        if (Dp == IfDescEp) {
-            strncpy( Dp->Name, IfPt->ifr_name, sizeof( IfDescEp->Name ) );
-        }
-
         if ( IfPt->ifr_addr.sa_family != AF_INET ) {
+            for (Dp = IfDescVc; Dp < IfDescEp; Dp++) {
+                if (0 == strcmp(Dp->Name, IfPt->ifr_name)) {
+                    break;
+                }
+            }
             if (Dp == IfDescEp) {
+                if (IfDescEp == VCEP(IfDescVc))
+                    continue;
+                strncpy( Dp->Name, IfPt->ifr_name, sizeof( IfDescEp->Name ) );
                 IfDescEp++;
             }
             Dp->InAdr.s_addr = 0;  /* mark as non-IP interface */
             continue;
         }
 
-        // Get the interface adress...
-        Dp->InAdr.s_addr = s_addr_from_sockaddr(&IfPt->ifr_addr);
-        addr = Dp->InAdr.s_addr;
+        updateIfDesc(Sock, IfPt->ifr_name, s_addr_from_sockaddr(&IfPt->ifr_addr));
+    }
 
-        memcpy( IfReq.ifr_name, Dp->Name, sizeof( IfReq.ifr_name ) );
+    // aimwang: search not longer exist IF, set as hidden and call delVIF
+    for (Dp = IfDescVc; Dp < IfDescEp; Dp++) {
+        if (IF_STATE_LOST == Dp->state) {
+            hideIfDesc(Dp);
+        }
+    }
 
-        if (ioctl(Sock, SIOCGIFINDEX, &IfReq ) < 0)
-            my_log(LOG_ERR, errno, "ioctl SIOCGIFINDEX for %s", IfReq.ifr_name);
-        Dp->ifIndex = IfReq.ifr_ifindex;
+    indexIfVc();
 
-        // Get the subnet mask...
-        if (ioctl(Sock, SIOCGIFNETMASK, &IfReq ) < 0)
-            my_log(LOG_ERR, errno, "ioctl SIOCGIFNETMASK for %s", IfReq.ifr_name);
-        mask = s_addr_from_sockaddr(&IfReq.ifr_addr); // Do not use ifr_netmask as it is not available on freebsd
-        subnet = addr & mask;
+    close( Sock );
+}
 
-        if ( ioctl( Sock, SIOCGIFFLAGS, &IfReq ) < 0 )
-            my_log( LOG_ERR, errno, "ioctl SIOCGIFFLAGS" );
-        Dp->Flags = IfReq.ifr_flags;
+/*
+** Rereads the interface 'name' after the kernel told it has changed.
+** A downstream interface without an address any more is hidden.
+*/
+static void refreshIfDesc(int Sock, const char *name) {
+    struct IfDesc *Dp;
+    struct ifreq IfReq;
 
-        if (0x10d1 == Dp->Flags)
-        {
-            if ( ioctl( Sock, SIOCGIFDSTADDR, &IfReq ) < 0 )
-                my_log(LOG_ERR, errno, "ioctl SIOCGIFDSTADDR for %s", IfReq.ifr_name);
-            addr = s_addr_from_sockaddr(&IfReq.ifr_dstaddr);
-            subnet = addr & mask;
+    memset(&IfReq, 0, sizeof(IfReq));
+    strncpy(IfReq.ifr_name, name, sizeof(IfReq.ifr_name) - 1);
+    if (ioctl(Sock, SIOCGIFADDR, &IfReq) == 0 && IfReq.ifr_addr.sa_family == AF_INET) {
+        updateIfDesc(Sock, name, s_addr_from_sockaddr(&IfReq.ifr_addr));
+        return;
+    }
+
+    for (Dp = IfDescVc; Dp < IfDescEp; Dp++) {
+        if (0 == strcmp(Dp->Name, name)) {
+            if (Dp->state == IF_STATE_DOWNSTREAM)
+                hideIfDesc(Dp);
+            return;
         }
+    }
+}
 
-        if (Dp == IfDescEp) {
-            // Insert the verified subnet as an allowed net...
-            Dp->allowednets = (struct SubnetList *)malloc(sizeof(struct SubnetList));
-            if(IfDescEp->allowednets == NULL) {
-                my_log(LOG_ERR, 0, "Out of memory !");
+#ifdef HAVE_LINUX_RTNETLINK_H
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+static int IfWatchFD = -1;
+
+/*
+** Handles a link or IPv4 address change reported on the RTNETLINK socket.
+** Returns 0 if the message was not about an interface.
+*/
+static int handleIfEvent(int Sock, struct nlmsghdr *nlh) {
+    char name[IF_NAMESIZE];
+    struct IfDesc *Dp;
+    struct rtattr *rta;
+    int len, ifindex;
+
+    name[0] = '\0';
+
+    switch (nlh->nlmsg_type) {
+    case RTM_NEWADDR:
+    case RTM_DELADDR: {
+        struct ifaddrmsg *ifa = NLMSG_DATA(nlh);
+
+        if (ifa->ifa_family != AF_INET)
+            return 1;
+        ifindex = ifa->ifa_index;
+        len = IFA_PAYLOAD(nlh);
+        for (rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+            if (rta->rta_type == IFA_LABEL) {
+                strncpy(name, RTA_DATA(rta), sizeof(name) - 1);
+                name[sizeof(name) - 1] = '\0';
             }
-            Dp->allowednets->next = NULL;
-            Dp->state         = IF_STATE_DOWNSTREAM;
-            Dp->robustness    = DEFAULT_ROBUSTNESS;
-            Dp->threshold     = DEFAULT_THRESHOLD;   /* ttl limit */
-            Dp->ratelimit     = DEFAULT_RATELIMIT;
         }
+        break;
+    }
+    case RTM_NEWLINK:
+    case RTM_DELLINK: {
+        struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+
+        ifindex = ifi->ifi_index;
+        len = IFLA_PAYLOAD(nlh);
+        for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+            if (rta->rta_type == IFLA_IFNAME) {
+                strncpy(name, RTA_DATA(rta), sizeof(name) - 1);
+                name[sizeof(name) - 1] = '\0';
+            }
+        }
+        break;
+    }
+    default:
+        return 0;
+    }
 
-        // Set the network address for the IF..
-        Dp->allowednets->subnet_mask = mask;
-        Dp->allowednets->subnet_addr = subnet;
+    if (name[0] == '\0' && if_indextoname(ifindex, name) == NULL)
+        name[0] = '\0';
 
-        // Set the state for the IF...
-        if (Dp->state == IF_STATE_LOST) {
-            Dp->state         = IF_STATE_DOWNSTREAM;
-        }
+    my_log(LOG_DEBUG, 0, "Interface %s (ifindex %d) changed", name[0] ? name : "?", ifindex);
 
-        // when IF become enabeld from downstream, addVIF to enable its VIF
-        if (Dp->state == IF_STATE_HIDDEN) {
-            my_log(LOG_NOTICE, 0, "%s [Hidden -> Downstream]", Dp->Name);
-            Dp->state = IF_STATE_DOWNSTREAM;
-            addVIF(Dp);
-            k_join(Dp, allrouters_group);
-        }
+    if (name[0])
+        refreshIfDesc(Sock, name);
 
-        // addVIF when found new IF
-        if (Dp == IfDescEp) {
-            my_log(LOG_NOTICE, 0, "%s [New]", Dp->Name);
-            Dp->state = config->defaultInterfaceState;
-            addVIF(Dp);
-            k_join(Dp, allrouters_group);
-            IfDescEp++;
+    // Aliases share the index of their interface.
+    for (Dp = IfDescVc; Dp < IfDescEp; Dp++) {
+        if (Dp->ifIndex == ifindex && strcmp(Dp->Name, name) != 0)
+            refreshIfDesc(Sock, Dp->Name);
+    }
+    return 1;
+}
+
+/*
+** Reads the pending messages of the RTNETLINK socket.
+*/
+static void readIfEvents(int fd, void *arg) {
+    char buf[16384];
+    struct nlmsghdr *nlh;
+    int len, Sock, changed = 0;
+
+    (void)arg;
+    if ( (Sock = socket( AF_INET, SOCK_DGRAM, 0 )) < 0 )
+        my_log( LOG_ERR, errno, "RAW socket open" );
+
+    while ((len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) != 0) {
+        if (len < 0) {
+            if (errno == ENOBUFS) {
+                // Messages were lost, read everything again.
+                my_log(LOG_INFO, 0, "Interface events lost, rescanning interfaces.");
+                close(Sock);
+                rebuildIfVc();
+                return;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                my_log(LOG_WARNING, errno, "recv RTNETLINK");
+            break;
+        }
+        for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, (unsigned int)len); nlh = NLMSG_NEXT(nlh, len)) {
+            changed |= handleIfEvent(Sock, nlh);
         }
+    }
+
+    if (changed)
+        indexIfVc();
+    close(Sock);
+}
 
-        // Debug log the result...
-        my_log( LOG_DEBUG, 0, "rebuildIfVc: Interface %s Index: %d Addr: %s, Flags: 0x%04x, Network: %s",
-            Dp->Name,
-            Dp->ifIndex,
-            fmtInAdr( FmtBu, Dp->InAdr ),
-            Dp->Flags,
-            inetFmts(subnet, mask, s1));
+/*
+** Starts watching for interface changes with RTNETLINK.
+** Returns 0 if that is not possible, and the interfaces must be polled.
+*/
+int watchIfVc(void) {
+    struct sockaddr_nl sa;
+
+    if ((IfWatchFD = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0) {
+        my_log(LOG_WARNING, errno, "RTNETLINK socket open");
+        return 0;
     }
 
-    // aimwang: search not longer exist IF, set as hidden and call delVIF
-    for (Dp = IfDescVc; Dp < IfDescEp; Dp++) {
-        if (IF_STATE_LOST == Dp->state) {
-            my_log(LOG_NOTICE, 0, "%s [Downstream -> Hidden]", Dp->Name);
-            Dp->state = IF_STATE_HIDDEN;
-            k_leave(Dp, allrouters_group);
-            delVIF(Dp);
-        }
+    memset(&sa, 0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+    if (bind(IfWatchFD, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        my_log(LOG_WARNING, errno, "RTNETLINK bind");
+        close(IfWatchFD);
+        IfWatchFD = -1;
+        return 0;
     }
 
-    close( Sock );
+    if (event_addFd(IfWatchFD, readIfEvents, NULL) < 0) {
+        close(IfWatchFD);
+        IfWatchFD = -1;
+        return 0;
+    }
+
+    // Changes made before the socket was opened are not reported.
+    rebuildIfVc();
+    return 1;
+}
+#else
+int watchIfVc(void) {
+    return 0;
 }
+#endif
 
 /*
 ** Builds up a vector with the interface of the machine. Calls to the other functions of
@@ -333,6 +659,8 @@ void buildIfVc(void) {
         }
     }
 
+    indexIfVc();
+
     close( Sock );
 }
 
@@ -365,32 +693,54 @@ struct IfDesc *getIfByIx( unsigned Ix ) {
     return Dp < IfDescEp ? Dp : NULL;
 }
 
+/**
+*   Looks up the interfaces whose allowed nets cover 'ipaddr'. Returns
+*   the interface with the most specific net, or NULL if there is none,
+*   and sets 'ifBits' to the set of IfDescVc indexes of all interfaces
+*   with a net covering the address.
+*/
+struct IfDesc *lookupIfByAddress( uint32_t ipaddr, uint64_t *ifBits ) {
+    uint32_t    addr = ntohl(ipaddr);
+    unsigned    n = 0, next;
+    int         bit;
+
+    if (IfNetTrie == NULL) {
+        *ifBits = 0;
+        return NULL;
+    }
+
+    for (bit = 31; bit >= 0; bit--) {
+        if ((next = IfNetTrie[n].child[(addr >> bit) & 1]) == 0)
+            break;
+        n = next;
+    }
+
+    *ifBits = IfNetTrie[n].ifBits;
+    return IfNetTrie[n].owner < 0 ? NULL : &IfDescVc[IfNetTrie[n].owner];
+}
+
 /**
 *   Returns a pointer to the IfDesc whose subnet matches
 *   the supplied IP adress. The IP must match a interfaces
 *   subnet, or any configured allowed subnet on a interface.
 */
 struct IfDesc *getIfByAddress( uint32_t ipaddr ) {
+    uint64_t    ifBits;
 
-    struct IfDesc       *Dp;
-    struct SubnetList   *currsubnet;
-    struct IfDesc       *res = NULL;
-    uint32_t            last_subnet_mask = 0;
-
-    for ( Dp = IfDescVc; Dp < IfDescEp; Dp++ ) {
-        // Loop through all registered allowed nets of the VIF...
-        for(currsubnet = Dp->allowednets; currsubnet != NULL; currsubnet = currsubnet->next) {
-            // Check if the ip falls in under the subnet....
-            if(currsubnet->subnet_mask > last_subnet_mask && (ipaddr & currsubnet->subnet_mask) == currsubnet->subnet_addr) {
-                res = Dp;
-                last_subnet_mask = currsubnet->subnet_mask;
-            }
-        }
-    }
-    return res;
+    return lookupIfByAddress(ipaddr, &ifBits);
 }
 
 
+/*
+** Returns a pointer to the IfDesc of the interface with the kernel
+** interface index 'ifindex', or NULL if it is not known.
+*/
+struct IfDesc *getIfByIfIndex( int ifindex ) {
+    if (ifindex <= 0 || ifindex >= IfIndexMapSize)
+        return NULL;
+    return IfIndexMap[ifindex];
+}
+
 /**
 *   Returns a pointer to the IfDesc whose subnet matches
 *   the supplied IP adress. The IP must match a interfaces
@@ -414,18 +764,12 @@ struct IfDesc *getIfByVifIndex( unsigned vifindex ) {
 *   address for the supplied VIF.
 */
 int isAdressValidForIf( struct IfDesc* intrface, uint32_t ipaddr ) {
-    struct SubnetList   *currsubnet;
+    uint64_t    ifBits;
 
     if(intrface == NULL) {
         return 0;
     }
 
-    // Loop through all registered allowed nets of the VIF...
-    for(currsubnet = intrface->allowednets; currsubnet != NULL; currsubnet = currsubnet->next) {
-        // Check if the ip falls in under the subnet....
-        if((ipaddr & currsubnet->subnet_mask) == (currsubnet->subnet_addr& currsubnet->subnet_mask)) {
-            return 1;
-        }
-    }
-    return 0;
+    lookupIfByAddress(ipaddr, &ifBits);
+    return (ifBits >> (intrface - IfDescVc)) & 1;
 }
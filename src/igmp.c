@@ -46,20 +46,128 @@ uint32_t     alligmp3_group;            /* IGMPv3 addr in net order */
 
 extern int MRouterFD;
 
+// The interface of a packet is given per packet with IP_PKTINFO where the
+// system supports it. Elsewhere IP_MULTICAST_IF is set before each send,
+// and the receiving interface is taken from IP_RECVIF.
+#ifdef HAVE_STRUCT_IN_PKTINFO_IPI_SPEC_DST
+#define USE_PKTINFO 1
+#define RECV_CTL_SIZE   CMSG_SPACE(sizeof(struct in_pktinfo))
+#elif defined(IP_RECVIF)
+#include <net/if_dl.h>
+#define RECV_CTL_SIZE   CMSG_SPACE(sizeof(struct sockaddr_dl))
+#endif
+
+// Number of buffers in the receive ring, and the most packets read
+// from the socket before returning to the event loop.
+static unsigned int recvBatch, recvBudget;
+
+#ifdef HAVE_RECVMMSG
+static struct mmsghdr   *recvMsgs;
+#define RECVHDR(i)      (recvMsgs[i].msg_hdr)
+#else
+static struct msghdr    *recvMsgs;
+#define RECVHDR(i)      (recvMsgs[i])
+#endif
+static struct iovec     *recvIov;
+
+// Ancillary data buffers of the receive ring.
+#ifdef RECV_CTL_SIZE
+union RecvCtl {
+    struct cmsghdr  align;
+    char            buf[RECV_CTL_SIZE];
+};
+static union RecvCtl    *recvCtl;
+#endif
+
+// Queue of packets built but not yet sent. Packets are queued between
+// sendIgmpBatch() and sendIgmpFlush(), and sent with a single sendmmsg()
+// call where possible.
+#define SEND_BATCH      64
+#define SEND_ARENA_SIZE (2 * RECV_BUF_SIZE)
+
+#if defined(HAVE_SENDMMSG) && defined(USE_PKTINFO)
+static struct mmsghdr   sendMsgs[SEND_BATCH];
+#define SENDHDR(i)      (sendMsgs[i].msg_hdr)
+#else
+static struct msghdr    sendMsgs[SEND_BATCH];
+#define SENDHDR(i)      (sendMsgs[i])
+#endif
+
+static struct SendInfo {
+    uint32_t            src;
+    int                 ifidx;
+    struct iovec        iov;
+    struct sockaddr_in  dst;
+#ifdef USE_PKTINFO
+    union {
+        struct cmsghdr  align;
+        char            buf[CMSG_SPACE(sizeof(struct in_pktinfo))];
+    } ctl;
+#endif
+} sendInfo[SEND_BATCH];
+
+static char             sendArena[SEND_ARENA_SIZE];
+static unsigned int     sendCount, sendArenaUsed;
+static int              sendBatching;
+
+// Receive statistics. Batches are counted in power of two buckets of
+// the number of packets they held: 1, 2-3, 4-7 and so on.
+#define RECV_BATCH_BUCKETS 9
+static unsigned long recvPackets, recvCalls, recvBudgetHits;
+static unsigned long recvBatches[RECV_BATCH_BUCKETS];
+
 /*
  * Open and initialize the igmp socket, and fill in the non-changing
  * IP header fields in the output packet buffer.
  */
 void initIgmp(void) {
+    struct Config *config = getCommonConfig();
     struct ip *ip;
+    unsigned int i;
+    int on = 1;
+
+    recvBatch = config->recvBatch;
+    recvBudget = config->recvBudget;
 
-    recv_buf = malloc(RECV_BUF_SIZE);
+    recv_buf = malloc(RECV_BUF_SIZE * recvBatch);
     send_buf = malloc(RECV_BUF_SIZE);
+    if (!recv_buf || !send_buf)
+        my_log(LOG_ERR, 0, "Out of memory.");
+
+#ifdef RECV_CTL_SIZE
+    recvCtl = calloc(recvBatch, sizeof(*recvCtl));
+    if (!recvCtl)
+        my_log(LOG_ERR, 0, "Out of memory.");
+#endif
+
+    recvIov = calloc(recvBatch, sizeof(*recvIov));
+#ifdef HAVE_RECVMMSG
+    recvMsgs = calloc(recvBatch, sizeof(*recvMsgs));
+#else
+    recvMsgs = calloc(1, sizeof(*recvMsgs));
+#endif
+    if (!recvMsgs || !recvIov)
+        my_log(LOG_ERR, 0, "Out of memory.");
+    for (i = 0; i < recvBatch; i++) {
+        recvIov[i].iov_base = recv_buf + i * RECV_BUF_SIZE;
+        recvIov[i].iov_len = RECV_BUF_SIZE;
+    }
+
+    // Ask for the interface each packet is received on.
+#ifdef USE_PKTINFO
+    if (setsockopt(MRouterFD, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on)) < 0)
+        my_log(LOG_WARNING, errno, "setsockopt IP_PKTINFO");
+#elif defined(IP_RECVIF)
+    if (setsockopt(MRouterFD, IPPROTO_IP, IP_RECVIF, &on, sizeof(on)) < 0)
+        my_log(LOG_WARNING, errno, "setsockopt IP_RECVIF");
+#else
+    (void)on;
+#endif
 
     k_hdr_include(true);    /* include IP header when sending */
     k_set_rcvbuf(256*1024,48*1024); /* lots of input buffering        */
     k_set_ttl(1);       /* restrict multicasts to one hop */
-    k_set_loop(false);      /* disable multicast loopback     */
+    k_set_loop(true);       /* loop back our own queries      */
 
     ip         = (struct ip *)send_buf;
     memset(ip, 0, sizeof(struct ip));
@@ -99,11 +207,133 @@ static const char *igmpPacketKind(unsigned int type, unsigned int code) {
     }
 }
 
+/**
+*   Counts a batch of 'n' packets read from the socket.
+*/
+static void countBatch(unsigned int n) {
+    unsigned int b = 0;
+
+    recvPackets += n;
+    while (n > 1 && b < RECV_BATCH_BUCKETS - 1) {
+        n >>= 1;
+        b++;
+    }
+    recvBatches[b]++;
+}
+
+/**
+*   Prepares the message header of ring buffer 'i' for receiving.
+*/
+static void setupRecvMsg(struct msghdr *msg, unsigned int i) {
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_iov = &recvIov[i];
+    msg->msg_iovlen = 1;
+#ifdef RECV_CTL_SIZE
+    msg->msg_control = recvCtl[i].buf;
+    msg->msg_controllen = sizeof(recvCtl[i].buf);
+#endif
+}
+
+/**
+*   Returns the index of the interface a message was received on,
+*   or 0 if the kernel did not tell.
+*/
+static int recvIfIndex(struct msghdr *msg) {
+#ifdef RECV_CTL_SIZE
+    struct cmsghdr *cmsg;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != IPPROTO_IP)
+            continue;
+#ifdef USE_PKTINFO
+        if (cmsg->cmsg_type == IP_PKTINFO) {
+            struct in_pktinfo pki;
+            memcpy(&pki, CMSG_DATA(cmsg), sizeof(pki));
+            return pki.ipi_ifindex;
+        }
+#else
+        if (cmsg->cmsg_type == IP_RECVIF) {
+            struct sockaddr_dl sdl;
+            memcpy(&sdl, CMSG_DATA(cmsg), sizeof(sdl));
+            return sdl.sdl_index;
+        }
+#endif
+    }
+#else
+    (void)msg;
+#endif
+    return 0;
+}
+
+/**
+*   Reads the pending IGMP packets from the socket, and handles them.
+*   Called from the event loop when the socket is readable. At most
+*   'recvbudget' packets are read, anything left over is read on the
+*   next round so timers and signals are not starved.
+*/
+void recvIgmp(int fd, void *arg) {
+    unsigned int total = 0, i;
+    int n;
+
+    (void)arg;
+    while (total < recvBudget) {
+#ifdef HAVE_RECVMMSG
+        unsigned int want = recvBudget - total < recvBatch ? recvBudget - total : recvBatch;
+
+        for (i = 0; i < want; i++)
+            setupRecvMsg(&RECVHDR(i), i);
+        n = recvmmsg(fd, recvMsgs, want, MSG_DONTWAIT, NULL);
+        recvCalls++;
+        if (n <= 0) {
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                my_log(LOG_ERR, errno, "recvmmsg");
+            return;
+        }
+        countBatch(n);
+        for (i = 0; i < (unsigned int)n; i++) {
+            acceptIgmp(recvIov[i].iov_base, recvMsgs[i].msg_len, recvIfIndex(&RECVHDR(i)));
+        }
+        total += n;
+        if ((unsigned int)n < want)
+            return;
+#else
+        setupRecvMsg(&RECVHDR(0), 0);
+        n = recvmsg(fd, &RECVHDR(0), MSG_DONTWAIT);
+        recvCalls++;
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                my_log(LOG_ERR, errno, "recvmsg");
+            return;
+        }
+        countBatch(1);
+        acceptIgmp(recv_buf, n, recvIfIndex(&RECVHDR(0)));
+        total++;
+        (void)i;
+#endif
+    }
+    recvBudgetHits++;
+}
+
+/**
+*   Writes the receive statistics to 'fp', or to the log if 'fp' is NULL.
+*/
+void igmpDumpStats(FILE *fp) {
+    unsigned int b;
+
+    statsLine(fp, "igmp.recv.packets %lu", recvPackets);
+    statsLine(fp, "igmp.recv.calls %lu", recvCalls);
+    statsLine(fp, "igmp.recv.budgethits %lu", recvBudgetHits);
+    for (b = 0; b < RECV_BATCH_BUCKETS && (1u << b) <= recvBatch; b++) {
+        statsLine(fp, "igmp.recv.batch.%u %lu", 1u << b, recvBatches[b]);
+    }
+}
+
 /**
  * Process a newly received IGMP packet that is sitting in the input
- * packet buffer.
+ * packet buffer 'buf'. 'ifindex' is the interface it was received on,
+ * or 0 if unknown.
  */
-void acceptIgmp(int recvlen) {
+void acceptIgmp(char *buf, int recvlen, int ifindex) {
     register uint32_t src, dst, group;
     struct ip *ip;
     struct igmp *igmp;
@@ -117,7 +347,7 @@ void acceptIgmp(int recvlen) {
         return;
     }
 
-    ip        = (struct ip *)recv_buf;
+    ip        = (struct ip *)buf;
     src       = ip->ip_src.s_addr;
     dst       = ip->ip_dst.s_addr;
 
@@ -131,7 +361,12 @@ void acceptIgmp(int recvlen) {
             my_log(LOG_WARNING, 0, "kernel request not accurate");
         }
         else {
-            struct IfDesc *checkVIF;
+            struct IfDesc *checkVIF, *downVIF;
+            uint64_t srcIfs;
+            int activated = 0;
+
+            // Find all interfaces the source is valid for at once.
+            downVIF = lookupIfByAddress(src, &srcIfs);
 
             for(i=0; i<MAX_UPS_VIFS; i++)
             {
@@ -148,8 +383,7 @@ void acceptIgmp(int recvlen) {
                             inetFmt(src, s1), inetFmt(dst, s2));
                         return;
                     }
-                    else if(!isAdressValidForIf(checkVIF, src)) {
-                        struct IfDesc *downVIF = getIfByAddress(src);
+                    else if(!(srcIfs & ((uint64_t)1 << upStreamIfIdx[i]))) {
                         if (downVIF && downVIF->state & IF_STATE_DOWNSTREAM) {
                             my_log(LOG_NOTICE, 0, "The source address %s for group %s is from downstream VIF[%d]. Ignoring.",
                                 inetFmt(src, s1), inetFmt(dst, s2), i);
@@ -163,12 +397,18 @@ void acceptIgmp(int recvlen) {
                         my_log(LOG_DEBUG, 0, "Route activate request from %s to %s on VIF[%d]",
                             inetFmt(src,s1), inetFmt(dst,s2), vifindex);
                         activateRoute(dst, src, vifindex);
+                        activated = 1;
                         i = MAX_UPS_VIFS;
                     }
                 } else {
                     i = MAX_UPS_VIFS;
                 }
             }
+
+            // Stop the kernel from reporting a flow that is not forwarded.
+            if (!activated) {
+                dropCacheAdd(src, dst, ((struct igmpmsg *)buf)->im_vif);
+            }
         }
         return;
     }
@@ -183,7 +423,7 @@ void acceptIgmp(int recvlen) {
         return;
     }
 
-    igmp = (struct igmp *)(recv_buf + iphdrlen);
+    igmp = (struct igmp *)(buf + iphdrlen);
     if ((ipdatalen < IGMP_MINLEN) ||
         (igmp->igmp_type == IGMP_V3_MEMBERSHIP_REPORT && ipdatalen <= IGMPV3_MINLEN)) {
         my_log(LOG_WARNING, 0,
@@ -200,11 +440,11 @@ void acceptIgmp(int recvlen) {
     case IGMP_V1_MEMBERSHIP_REPORT:
     case IGMP_V2_MEMBERSHIP_REPORT:
         group = igmp->igmp_group.s_addr;
-        acceptGroupReport(src, group);
+        acceptGroupReport(src, group, ifindex);
         return;
 
     case IGMP_V3_MEMBERSHIP_REPORT:
-        igmpv3 = (struct igmpv3_report *)(recv_buf + iphdrlen);
+        igmpv3 = (struct igmpv3_report *)(buf + iphdrlen);
         grec = &igmpv3->igmp_grec[0];
         ngrec = ntohs(igmpv3->igmp_ngrec);
         while (ngrec--) {
@@ -212,19 +452,24 @@ void acceptIgmp(int recvlen) {
                 break;
             group = grec->grec_mca.s_addr;
             nsrcs = ntohs(grec->grec_nsrcs);
+            if ((uint8_t *)igmpv3 + ipdatalen < (uint8_t *)&grec->grec_src[nsrcs])
+                break;
             switch (grec->grec_type) {
             case IGMPV3_MODE_IS_INCLUDE:
             case IGMPV3_CHANGE_TO_INCLUDE:
                 if (nsrcs == 0) {
-                    acceptLeaveMessage(src, group);
+                    acceptLeaveMessage(src, group, ifindex);
                     break;
                 } /* else fall through */
-            case IGMPV3_MODE_IS_EXCLUDE:
-            case IGMPV3_CHANGE_TO_EXCLUDE:
             case IGMPV3_ALLOW_NEW_SOURCES:
-                acceptGroupReport(src, group);
-                break;
             case IGMPV3_BLOCK_OLD_SOURCES:
+                acceptSourceReport(src, group, grec->grec_type, nsrcs,
+                                   grec->grec_src, ifindex);
+                break;
+            case IGMPV3_MODE_IS_EXCLUDE:
+            case IGMPV3_CHANGE_TO_EXCLUDE:
+                // EXCLUDE mode members get all sources of the group.
+                acceptGroupReport(src, group, ifindex);
                 break;
             default:
                 my_log(LOG_INFO, 0,
@@ -240,10 +485,16 @@ void acceptIgmp(int recvlen) {
 
     case IGMP_V2_LEAVE_GROUP:
         group = igmp->igmp_group.s_addr;
-        acceptLeaveMessage(src, group);
+        acceptLeaveMessage(src, group, ifindex);
         return;
 
     case IGMP_MEMBERSHIP_QUERY:
+        // The proxy answers the upstream queriers itself with 'upstreamreports'.
+        if (getCommonConfig()->upstreamReports) {
+            acceptUpstreamQuery(src, igmp->igmp_group.s_addr,
+                ipdatalen >= IGMPV3_MINLEN ? 3 : igmp->igmp_code != 0 ? 2 : 1,
+                igmp->igmp_code, ifindex);
+        }
         return;
 
     default:
@@ -288,56 +539,127 @@ static void buildIgmp(uint32_t src, uint32_t dst, int type, int code, uint32_t g
     igmp->igmp_group.s_addr = group;
     igmp->igmp_cksum        = 0;
     igmp->igmp_cksum        = inetChksum((unsigned short *)igmp,
-                                         IP_HEADER_RAOPT_LEN + datalen);
+                                         IGMP_MINLEN + datalen);
 
 }
 
 /*
- * Call build_igmp() to build an IGMP message in the output packet buffer.
- * Then send the message from the interface with IP address 'src' to
- * destination 'dst'. If struct ip_mreqn is present on the target OS, it is
- * used instead of 'src' to select the sending interface. 'src' is still used
- * as the source IP.
+ * Sends the queued packets. With IP_PKTINFO and sendmmsg() the whole
+ * queue goes out in one system call, otherwise one packet at a time.
  */
-void sendIgmp(uint32_t src, uint32_t dst, int type, int code, uint32_t group, int datalen, int ifidx) {
-    struct sockaddr_in sdst;
-    int setloop = 0, setigmpsource = 0;
-
-    buildIgmp(src, dst, type, code, group, datalen);
-
-    if (IN_MULTICAST(ntohl(dst))) {
-        k_set_if(src, ifidx);
-        setigmpsource = 1;
-        if (type != IGMP_DVMRP || dst == allhosts_group) {
-            setloop = 1;
-            k_set_loop(true);
+static void flushSendQueue(void) {
+    unsigned int i = 0;
+    int n;
+
+    while (i < sendCount) {
+#if defined(HAVE_SENDMMSG) && defined(USE_PKTINFO)
+        n = sendmmsg(MRouterFD, &sendMsgs[i], sendCount - i, 0);
+#else
+#ifndef USE_PKTINFO
+        if (IN_MULTICAST(ntohl(sendInfo[i].dst.sin_addr.s_addr)))
+            k_set_if(sendInfo[i].src, sendInfo[i].ifidx);
+#endif
+        n = sendmsg(MRouterFD, &SENDHDR(i), 0) < 0 ? -1 : 1;
+#endif
+        if (n > 0) {
+            i += n;
+            continue;
         }
-    }
 
-    memset(&sdst, 0, sizeof(sdst));
-    sdst.sin_family = AF_INET;
-#ifdef HAVE_STRUCT_SOCKADDR_IN_SIN_LEN
-    sdst.sin_len = sizeof(sdst);
-#endif
-    sdst.sin_addr.s_addr = dst;
-    if (sendto(MRouterFD, send_buf,
-               IP_HEADER_RAOPT_LEN + IGMP_MINLEN + datalen, 0,
-               (struct sockaddr *)&sdst, sizeof(sdst)) < 0) {
+        // Packet 'i' failed, report it and go on with the rest.
         if (errno == ENETDOWN)
             my_log(LOG_ERR, errno, "Sender VIF was down.");
         else
             my_log(LOG_INFO, errno,
                 "sendto to %s on %s",
-                inetFmt(dst, s1), inetFmt(src, s2));
+                inetFmt(sendInfo[i].dst.sin_addr.s_addr, s1), inetFmt(sendInfo[i].src, s2));
+        i++;
     }
 
-    if(setigmpsource) {
-        if (setloop) {
-            k_set_loop(false);
-        }
-        // Restore original...
-        k_set_if(INADDR_ANY, 0);
+    sendCount = 0;
+    sendArenaUsed = 0;
+}
+
+/*
+ * Starts queueing the packets given to sendIgmp(), so that a round of
+ * queries can be sent at once by sendIgmpFlush().
+ */
+void sendIgmpBatch(void) {
+    sendBatching++;
+}
+
+/*
+ * Sends the packets queued since sendIgmpBatch().
+ */
+void sendIgmpFlush(void) {
+    if (sendBatching > 0)
+        sendBatching--;
+    if (sendBatching == 0)
+        flushSendQueue();
+}
+
+/*
+ * Call build_igmp() to build an IGMP message in the output packet buffer.
+ * Then queue the message to be sent from the interface with IP address
+ * 'src' to destination 'dst'. If IP_PKTINFO or struct ip_mreqn is present
+ * on the target OS, 'ifidx' is used instead of 'src' to select the sending
+ * interface. 'src' is still used as the source IP. Unless a batch was
+ * started with sendIgmpBatch(), the message is sent right away.
+ */
+void sendIgmp(uint32_t src, uint32_t dst, int type, int code, uint32_t group, int datalen, int ifidx) {
+    struct SendInfo *si;
+    struct msghdr *msg;
+    size_t len = IP_HEADER_RAOPT_LEN + IGMP_MINLEN + datalen;
+
+    buildIgmp(src, dst, type, code, group, datalen);
+
+    if (sendCount == SEND_BATCH || sendArenaUsed + len > SEND_ARENA_SIZE)
+        flushSendQueue();
+
+    si = &sendInfo[sendCount];
+    msg = &SENDHDR(sendCount);
+    memset(msg, 0, sizeof(*msg));
+
+    si->src = src;
+    si->ifidx = ifidx;
+    memcpy(sendArena + sendArenaUsed, send_buf, len);
+    si->iov.iov_base = sendArena + sendArenaUsed;
+    si->iov.iov_len = len;
+    sendArenaUsed += len;
+
+    memset(&si->dst, 0, sizeof(si->dst));
+    si->dst.sin_family = AF_INET;
+#ifdef HAVE_STRUCT_SOCKADDR_IN_SIN_LEN
+    si->dst.sin_len = sizeof(si->dst);
+#endif
+    si->dst.sin_addr.s_addr = dst;
+
+    msg->msg_name = &si->dst;
+    msg->msg_namelen = sizeof(si->dst);
+    msg->msg_iov = &si->iov;
+    msg->msg_iovlen = 1;
+
+#ifdef USE_PKTINFO
+    if (IN_MULTICAST(ntohl(dst))) {
+        struct cmsghdr *cmsg;
+        struct in_pktinfo *pki;
+
+        memset(&si->ctl, 0, sizeof(si->ctl));
+        msg->msg_control = si->ctl.buf;
+        msg->msg_controllen = sizeof(si->ctl.buf);
+        cmsg = CMSG_FIRSTHDR(msg);
+        cmsg->cmsg_level = IPPROTO_IP;
+        cmsg->cmsg_type = IP_PKTINFO;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+        pki = (struct in_pktinfo *)CMSG_DATA(cmsg);
+        pki->ipi_ifindex = ifidx;
+        pki->ipi_spec_dst.s_addr = src;
     }
+#endif
+
+    sendCount++;
+    if (!sendBatching)
+        flushSendQueue();
 
     my_log(LOG_DEBUG, 0, "SENT %s from %-15s to %s",
         igmpPacketKind(type, code),
@@ -57,20 +57,22 @@ PACKAGE_STRING "\n"
 
 // Local function Prototypes
 static void signalHandler(int);
+static void dumpStats(FILE *fp);
+static void rescanVifs(void *);
+static void collectStats(void *);
+static void writeStats(const char *path);
 int     igmpProxyInit(void);
 void    igmpProxyCleanUp(void);
 void    igmpProxyRun(void);
 
 // Global vars...
-static int sighandled = 0;
-#define GOT_SIGINT  0x01
-#define GOT_SIGHUP  0x02
-#define GOT_SIGUSR1 0x04
-#define GOT_SIGUSR2 0x08
-
 // Holds the indeces of the upstream IF...
 int     upStreamIfIdx[MAX_UPS_VIFS];
 
+// The VIF counters are sampled every STATS_TICK ms.
+#define STATS_TICK  1000
+static unsigned statsTicks;
+
 /**
 *   Program main method. Is invoked when the program is started
 *   on commandline. The number of commandline arguments, and a
@@ -203,14 +205,13 @@ int main( int ArgCn, char *ArgVc[] ) {
 *   Handles the initial startup of the daemon.
 */
 int igmpProxyInit(void) {
-    struct sigaction sa;
     int Err;
 
-    sa.sa_handler = signalHandler;
-    sa.sa_flags = 0;    /* Interrupt system calls */
-    sigemptyset(&sa.sa_mask);
-    sigaction(SIGTERM, &sa, NULL);
-    sigaction(SIGINT, &sa, NULL);
+    // Signals are handled from the event loop.
+    initEvents();
+    event_addSignal(SIGTERM, signalHandler);
+    event_addSignal(SIGINT, signalHandler);
+    event_addSignal(SIGUSR1, signalHandler);
 
     // Loads configuration for Physical interfaces...
     buildIfVc();
@@ -264,12 +265,20 @@ int igmpProxyInit(void) {
         }
     }
 
+    // Initialize timer
+    callout_init();
     // Initialize IGMP
     initIgmp();
     // Initialize Routing table
     initRouteTable();
-    // Initialize timer
-    callout_init();
+    // Initialize drop entries for unwanted flows
+    initDropCache();
+    // Initialize request handling
+    initRequest();
+    // Initialize the upstream reports
+    initReports();
+    // Initialize the pacing of upstream changes
+    initPacing();
 
     return 1;
 }
@@ -282,6 +291,9 @@ void igmpProxyCleanUp(void) {
 
     free_all_callouts();    // No more timeouts.
     clearAllRoutes();       // Remove all routes.
+    flushPacing();          // Leave the groups without pacing.
+    flushReports();         // Report the leaves upstream.
+    clearDropCache();       // Remove all drop entries.
     disableMRouter();       // Disable the multirout API
 }
 
@@ -291,134 +303,103 @@ void igmpProxyCleanUp(void) {
 void igmpProxyRun(void) {
     // Get the config.
     struct Config *config = getCommonConfig();
-    // Set some needed values.
-    register int recvlen;
-    int     MaxFD, Rt, secs;
-    fd_set  ReadFDS;
-    socklen_t dummy = 0;
-    struct  timespec  curtime, lasttime, difftime, tv;
-    // The timeout is a pointer in order to set it to NULL if nessecary.
-    struct  timespec  *timeout = &tv;
-
-    // Initialize timer vars
-    difftime.tv_nsec = 0;
-    clock_gettime(CLOCK_MONOTONIC, &curtime);
-    lasttime = curtime;
 
-    // First thing we send a membership query in downstream VIF's...
-    sendGeneralMembershipQuery();
-
-    // Loop until the end...
-    for (;;) {
-
-        // Process signaling...
-        if (sighandled) {
-            if (sighandled & GOT_SIGINT) {
-                sighandled &= ~GOT_SIGINT;
-                my_log(LOG_NOTICE, 0, "Got a interrupt signal. Exiting.");
-                break;
-            }
-        }
+    // Read IGMP requests as they arrive.
+    if (event_addFd(MRouterFD, recvIgmp, NULL) < 0)
+        my_log(LOG_ERR, 0, "Unable to watch the IGMP socket.");
 
-        /* aimwang: call rebuildIfVc */
-        if (config->rescanVif)
-            rebuildIfVc();
-
-        // Prepare timeout...
-        secs = timer_nextTimer();
-        if(secs == -1) {
-            timeout = NULL;
-        } else {
-            timeout->tv_nsec = 0;
-            timeout->tv_sec = (secs > 3) ? 3 : secs; // aimwang: set max timeout
-        }
+    /* aimwang: call rebuildIfVc */
+    if (config->rescanVif && !watchIfVc())
+        timer_setTimer(3000, rescanVifs, NULL);
 
-        // Prepare for select.
-        MaxFD = MRouterFD;
+    // Sample the traffic counters of the VIFs.
+    if (config->statsInterval)
+        timer_setTimer(STATS_TICK, collectStats, NULL);
 
-        FD_ZERO( &ReadFDS );
-        FD_SET( MRouterFD, &ReadFDS );
+    // First thing we send a membership query in downstream VIF's...
+    sendGeneralMembershipQuery();
 
-        // wait for input
-        Rt = pselect( MaxFD +1, &ReadFDS, NULL, NULL, timeout, NULL );
+    // Loop until the end...
+    event_loop();
+}
 
-        // log and ignore failures
-        if( Rt < 0 ) {
-            my_log( LOG_WARNING, errno, "select() failure" );
-            continue;
-        }
-        else if( Rt > 0 ) {
+/**
+*   Rebuilds the interface list every 3 seconds, when 'rescanvif' is set
+*   and the system can not tell about interface changes.
+*/
+static void rescanVifs(void *arg) {
+    rebuildIfVc();
+    timer_setTimer(3000, rescanVifs, arg);
+}
 
-            // Read IGMP request, and handle it...
-            if( FD_ISSET( MRouterFD, &ReadFDS ) ) {
+/**
+*   Samples a slice of the VIF counters every STATS_TICK ms, so that all
+*   VIFs are done once per 'statsinterval', and writes the statistics file
+*   at the end of each interval.
+*/
+static void collectStats(void *arg) {
+    struct Config *config = getCommonConfig();
+    unsigned ticks = config->statsInterval * 1000 / STATS_TICK;
 
-                recvlen = recvfrom(MRouterFD, recv_buf, RECV_BUF_SIZE,
-                                   0, NULL, &dummy);
-                if (recvlen < 0) {
-                    if (errno != EINTR) my_log(LOG_ERR, errno, "recvfrom");
-                    continue;
-                }
+    pollVifCounters((MAXVIFS + ticks - 1) / ticks);
+    if (++statsTicks >= ticks) {
+        statsTicks = 0;
+        writeStats(config->statsFile);
+    }
+    timer_setTimer(STATS_TICK, collectStats, arg);
+}
 
-                acceptIgmp(recvlen);
-            }
-        }
+/**
+*   Replaces the statistics file 'path' by a new one, so that readers never
+*   see a partly written file.
+*/
+static void writeStats(const char *path) {
+    char tmp[PATH_MAX + 4];
+    FILE *fp;
 
-        // At this point, we can handle timeouts...
-        do {
-            /*
-             * If the select timed out, then there's no other
-             * activity to account for and we don't need to
-             * call gettimeofday.
-             */
-            if (Rt == 0) {
-                curtime.tv_sec = lasttime.tv_sec + secs;
-                curtime.tv_nsec = lasttime.tv_nsec;
-                Rt = -1; /* don't do this next time through the loop */
-            } else {
-                clock_gettime(CLOCK_MONOTONIC, &curtime);
-            }
-            difftime.tv_sec = curtime.tv_sec - lasttime.tv_sec;
-            difftime.tv_nsec += curtime.tv_nsec - lasttime.tv_nsec;
-            while (difftime.tv_nsec > 1000000000) {
-                difftime.tv_sec++;
-                difftime.tv_nsec -= 1000000000;
-            }
-            if (difftime.tv_nsec < 0) {
-                difftime.tv_sec--;
-                difftime.tv_nsec += 1000000000;
-            }
-            lasttime = curtime;
-            if (secs == 0 || difftime.tv_sec > 0)
-                age_callout_queue(difftime.tv_sec);
-            secs = -1;
-        } while (difftime.tv_sec > 0);
+    if (!path[0])
+        return;
 
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        my_log(LOG_WARNING, errno, "Unable to write %s", tmp);
+        return;
+    }
+    dumpStats(fp);
+    if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+        my_log(LOG_WARNING, errno, "Unable to write %s", path);
+        unlink(tmp);
     }
+}
 
+/*
+ * Writes the internal statistics to 'fp', or to the log if 'fp' is NULL.
+ */
+static void dumpStats(FILE *fp) {
+    igmpDumpStats(fp);
+    routeDumpStats(fp);
+    requestDumpStats(fp);
+    reportsDumpStats(fp);
+    pacingDumpStats(fp);
+    dropCacheDumpStats(fp);
+    mrouteDumpStats(fp);
+    kernDumpStats(fp);
+    poolDumpStats(fp);
 }
 
 /*
- * Signal handler.  Take note of the fact that the signal arrived
- * so that the main loop can take care of it.
+ * Signal handler.  Called from the event loop when one of the
+ * registered signals has arrived.
  */
 static void signalHandler(int sig) {
     switch (sig) {
     case SIGINT:
     case SIGTERM:
-        sighandled |= GOT_SIGINT;
+        my_log(LOG_NOTICE, 0, "Got a interrupt signal. Exiting.");
+        event_stop();
+        break;
+    case SIGUSR1:
+        dumpStats(NULL);
         break;
-        /* XXX: Not in use.
-        case SIGHUP:
-            sighandled |= GOT_SIGHUP;
-            break;
-
-        case SIGUSR1:
-            sighandled |= GOT_SIGUSR1;
-            break;
-
-        case SIGUSR2:
-            sighandled |= GOT_SIGUSR2;
-            break;
-        */
     }
 }
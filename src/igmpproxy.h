@@ -48,6 +48,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 #include <grp.h>
 #include <limits.h>
@@ -112,6 +113,7 @@ extern bool Log2Stderr;           // Log to stderr instead of to syslog
 extern int  LogLevel;             // Log threshold, LOG_WARNING .... LOG_DEBUG
 
 void my_log( int Serverity, int Errno, const char *FmtSt, ... );
+void statsLine( FILE *fp, const char *FmtSt, ... );
 
 /* ifvc.c
  */
@@ -156,6 +158,7 @@ struct IfDesc {
     short               state;
     struct SubnetList*  allowednets;
     struct SubnetList*  allowedgroups;
+    struct GroupAcl*    groupAcl;       /* allowedgroups, compiled */
     unsigned int        robustness;
     unsigned char       threshold;   /* ttl limit */
     unsigned int        ratelimit;
@@ -166,17 +169,40 @@ struct IfDesc {
 struct Config {
     unsigned int        robustnessValue;
     unsigned int        queryInterval;
-    unsigned int        queryResponseInterval;
+    unsigned int        queryResponseInterval;      // In milliseconds
     // Used on startup..
     unsigned int        startupQueryInterval;
     unsigned int        startupQueryCount;
     // Last member probe...
-    unsigned int        lastMemberQueryInterval;
+    unsigned int        lastMemberQueryInterval;    // In milliseconds
     unsigned int        lastMemberQueryCount;
+    // Receive ring size, and packets read per event loop round.
+    unsigned int        recvBatch;
+    unsigned int        recvBudget;
+    // Set if MFC entries are written with netlink instead of setsockopt.
+    unsigned short      mfcNetlink;
+    // Set if (*,G) entries are installed for groups with listeners.
+    unsigned short      proxyMfc;
+    // Lifetime in seconds of drop entries for unwanted flows, 0 if off,
+    // and the most drop entries kept at once.
+    unsigned int        dropMfcLifetime;
+    unsigned int        dropMfcSize;
+    // Seconds after which an origin without traffic is removed, 0 if off.
+    unsigned int        sourceIdle;
+    // Seconds between samples of the traffic counters, 0 if off, and the
+    // file the statistics are written to after each sample.
+    unsigned int        statsInterval;
+    char                statsFile[PATH_MAX];
     // Set if upstream leave messages should be sent instantly..
     unsigned short      fastUpstreamLeave;
-    // Size in bytes of hash table of downstream hosts used for fast leave
-    unsigned int        downstreamHostsHashTableSize;
+    // Set if reports must come from an allowed net of the interface.
+    unsigned short      checkSubnets;
+    // Set if the proxy sends the upstream reports instead of the kernel.
+    unsigned short      upstreamReports;
+    // Upstream membership changes per second, 0 if not paced, and the
+    // most changes made at once.
+    unsigned int        upstreamRate;
+    unsigned int        upstreamBurst;
     //~ aimwang added
     // Set if nneed to detect new interface.
     unsigned short	rescanVif;
@@ -193,10 +219,14 @@ extern int upStreamIfIdx[MAX_UPS_VIFS];
 /* ifvc.c
  */
 void rebuildIfVc( void );
+int watchIfVc( void );
 void buildIfVc( void );
+void indexIfVc( void );
 struct IfDesc *getIfByName( const char *IfName );
 struct IfDesc *getIfByIx( unsigned Ix );
 struct IfDesc *getIfByAddress( uint32_t Ix );
+struct IfDesc *lookupIfByAddress( uint32_t ipaddr, uint64_t *ifBits );
+struct IfDesc *getIfByIfIndex( int ifindex );
 struct IfDesc *getIfByVifIndex( unsigned vifindex );
 int isAdressValidForIf(struct IfDesc* intrface, uint32_t ipaddr);
 
@@ -217,7 +247,11 @@ void disableMRouter( void );
 void addVIF( struct IfDesc *Dp );
 void delVIF( struct IfDesc *Dp );
 int addMRoute( struct MRouteDesc * Dp );
+void flushMRoutes( void );
+void mrouteDumpStats( FILE *fp );
 int delMRoute( struct MRouteDesc * Dp );
+int getMRouteCount( struct MRouteDesc *Dp, unsigned long *PktCnt, unsigned long *ByteCnt );
+void pollVifCounters( unsigned Count );
 int getVifIx( struct IfDesc *IfDp );
 
 /* config.c
@@ -232,8 +266,40 @@ extern uint32_t allhosts_group;
 extern uint32_t allrouters_group;
 extern uint32_t alligmp3_group;
 void initIgmp(void);
-void acceptIgmp(int);
+void recvIgmp(int, void *);
+void igmpDumpStats(FILE *);
+void acceptIgmp(char *, int, int);
 void sendIgmp (uint32_t, uint32_t, int, int, uint32_t, int, int);
+void sendIgmpBatch(void);
+void sendIgmpFlush(void);
+
+/* acl.c
+ */
+struct GroupAcl *compileGroupAcl(struct SubnetList *list);
+bool groupAclAllows(const struct GroupAcl *acl, uint32_t group);
+
+/* pacing.c
+ */
+void initPacing(void);
+void paceMembership(int ups, uint32_t group, uint32_t source, int join, int vif);
+void flushPacing(void);
+void pacingDumpStats(FILE *fp);
+
+/* reports.c
+ */
+void initReports(void);
+void reportChange(int ups, uint32_t group, int type, uint32_t source);
+void flushReports(void);
+void acceptUpstreamQuery(uint32_t src, uint32_t group, int version, int code, int ifindex);
+void reportsDumpStats(FILE *fp);
+
+/* ssmmap.c
+ */
+// Sources per mapped group prefix, as many as a route forwards at once.
+#define MAX_SSM_SOURCES     MAX_ORIGINS
+
+void addSsmMap(struct SubnetList *sn, int nsrcs, const struct in_addr *sources);
+int lookupSsmMap(uint32_t group, const struct in_addr **sources);
 
 /* lib.c
  */
@@ -251,35 +317,119 @@ void k_set_loop(int l);
 void k_set_if(uint32_t ifa, int ifidx);
 void k_join(struct IfDesc *ifd, uint32_t grp);
 void k_leave(struct IfDesc *ifd, uint32_t grp);
+void k_join_source(struct IfDesc *ifd, uint32_t grp, uint32_t src);
+void k_leave_source(struct IfDesc *ifd, uint32_t grp, uint32_t src);
+unsigned k_if_mtu(struct IfDesc *ifd);
+void kernDumpStats(FILE *fp);
 
 /* rttable.c
  */
+#define MAX_ORIGINS         4           // Sources forwarded per route.
+
 void initRouteTable(void);
 void clearAllRoutes(void);
 int insertRoute(uint32_t group, int ifx, uint32_t src);
+int updateRouteSources(uint32_t group, int ifx, uint32_t src, int type,
+                       int nsrcs, const struct in_addr *sources);
+uint32_t *getUpstreamGroups(int ups, unsigned *count);
+int getUpstreamState(uint32_t group, int ups, uint32_t *sources, int max, int *nsrcs);
 int activateRoute(uint32_t group, uint32_t originAddr, int upstrVif);
 void ageActiveRoutes(void);
-void setRouteLastMemberMode(uint32_t group, uint32_t src);
-int lastMemberGroupAge(uint32_t group);
-int interfaceInRoute(int32_t group, int Ix);
+int setRouteLastMemberMode(uint32_t group, int ifx, uint32_t src);
+int lastMemberVifCheck(uint32_t group, int ifx);
+void lastMemberVifExpire(uint32_t group, int ifx);
+void invalidateKernelRoutes(void);
+void routeDumpStats(FILE *fp);
+
+/* dropcache.c
+ */
+void initDropCache(void);
+void dropCacheAdd(uint32_t origin, uint32_t group, int inVif);
+void dropCacheForget(uint32_t origin, uint32_t group);
+void clearDropCache(void);
+void dropCacheDumpStats(FILE *fp);
 
 /* request.c
  */
-void acceptGroupReport(uint32_t src, uint32_t group);
-void acceptLeaveMessage(uint32_t src, uint32_t group);
+void initRequest(void);
+void acceptGroupReport(uint32_t src, uint32_t group, int ifindex);
+void acceptLeaveMessage(uint32_t src, uint32_t group, int ifindex);
+void acceptSourceReport(uint32_t src, uint32_t group, int type, int nsrcs,
+                        const struct in_addr *sources, int ifindex);
 void sendGeneralMembershipQuery(void);
+void requestDumpStats(FILE *fp);
 
 /* callout.c 
 */
 typedef void (*timer_f)(void *);
 
+// Handle of a scheduled timer, to be treated as opaque. A handle with
+// a NULL node refers to no timer. Handles stay safe to use after the
+// timer has expired or was cleared.
+typedef struct {
+    struct timeOutQueue *node;
+    unsigned long       id;
+} timer_h;
+
 void callout_init(void);
 void free_all_callouts(void);
 void age_callout_queue(int);
 int timer_nextTimer(void);
-int timer_setTimer(int, timer_f, void *);
-int timer_clearTimer(int);
-int timer_leftTimer(int);
+timer_h timer_setTimer(int, timer_f, void *);
+int timer_clearTimer(timer_h);
+int timer_leftTimer(timer_h);
+
+/* event.c
+ */
+typedef void (*event_f)(int, void *);
+typedef void (*signal_f)(int);
+
+void initEvents(void);
+int event_addFd(int, event_f, void *);
+void event_delFd(int);
+void event_addSignal(int, signal_f);
+void event_addHook(void (*)(void));
+void event_stop(void);
+void event_loop(void);
+
+/* pool.c
+ */
+struct Pool {
+    const char      *name;
+    size_t          size;           // Size of each object
+    unsigned        perSlab;        // Objects allocated at once
+    void            *freeList;      // Released objects ready for reuse
+    void            *slabs;         // All memory blocks of the pool
+    unsigned        total;          // Number of allocated objects
+    unsigned        inUse;          // Number of objects in use
+    unsigned        highWater;      // Highest number of objects in use
+    unsigned long   allocs;         // Number of successful allocations
+    unsigned long   failed;         // Number of failed allocations
+    struct Pool     *next;
+};
+
+void poolInit(struct Pool *pool, const char *name, size_t size);
+void *poolAlloc(struct Pool *pool);
+void poolFree(struct Pool *pool, void *obj);
+void poolDestroy(struct Pool *pool);
+void poolDumpStats(FILE *fp);
+
+/* hosts.c
+ */
+struct HostEntry;
+
+struct HostSet {
+    struct HostEntry    *list;          // Hosts of the group.
+    unsigned            count;          // Hosts on all VIFs.
+    unsigned            vifCount[MAXVIFS]; // Hosts per VIF.
+};
+
+void initHosts(void);
+void hostSetInit(struct HostSet *set);
+int hostAdd(struct HostSet *set, uint32_t group, int vif, uint32_t host);
+int hostDel(struct HostSet *set, uint32_t group, int vif, uint32_t host);
+void hostClearVif(struct HostSet *set, int vif);
+void hostClear(struct HostSet *set);
 
 /* confread.c
  */
@@ -289,3 +439,44 @@ int openConfigFile(char *filename);
 void closeConfigFile(void);
 char* nextConfigToken(void);
 char* getCurrentConfigToken(void);
+
+/* hash.c
+ */
+typedef uint32_t (*hash_f)(const void *entry);
+
+struct Hash {
+    void            **slots;        // Entries, NULL in free slots
+    unsigned        size;           // Number of slots, a power of two
+    unsigned        count;          // Number of entries
+    hash_f          func;           // Hash value of the key of an entry
+    const char      *name;
+};
+
+void hashInit(struct Hash *hash, const char *name, unsigned size, hash_f func);
+void hashInsert(struct Hash *hash, void *entry);
+void hashRemove(struct Hash *hash, void *entry);
+void hashClear(struct Hash *hash);
+
+// MurmurHash3 32bit finalizer by Austin Appleby, public domain
+static inline uint32_t hashMix(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x85ebca6b;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35;
+    x ^= x >> 16;
+    return x;
+}
+
+// Folds another part of a key into a hash value, before hashMix().
+static inline uint32_t hashCombine(uint32_t value, uint32_t x) {
+    return value * 0x9e3779b1 ^ x;
+}
+
+// First and following slots of the probe sequence of a hash value.
+static inline unsigned hashSlot(const struct Hash *hash, uint32_t value) {
+    return value & (hash->size - 1);
+}
+
+static inline unsigned hashNext(const struct Hash *hash, unsigned slot) {
+    return (slot + 1) & (hash->size - 1);
+}
@@ -37,6 +37,11 @@
 
 int curttl = 0;
 
+// The interface IP_MULTICAST_IF is currently set to.
+static bool     curIfValid = false;
+static uint32_t curIfAddr;
+static int      curIfIdx;
+
 void k_set_rcvbuf(int bufsize, int minsize) {
     int delta = bufsize / 2;
     int iter = 0;
@@ -101,6 +106,9 @@ void k_set_loop(int l) {
         my_log(LOG_WARNING, errno, "setsockopt IP_MULTICAST_LOOP %u", loop);
 }
 void k_set_if(uint32_t ifa, int ifidx) {
+    if (curIfValid && curIfAddr == ifa && curIfIdx == ifidx)
+        return;
+
 #ifdef HAVE_STRUCT_IP_MREQN
     struct ip_mreqn ifsel;
     ifsel.imr_address.s_addr = ifa;
@@ -111,53 +119,286 @@ void k_set_if(uint32_t ifa, int ifidx) {
 #endif
 
     if (setsockopt(MRouterFD, IPPROTO_IP, IP_MULTICAST_IF,
-                   (char *)&ifsel, sizeof(ifsel)) < 0)
+                   (char *)&ifsel, sizeof(ifsel)) < 0) {
         my_log(LOG_WARNING, errno, "setsockopt IP_MULTICAST_IF %s",
             inetFmt(ifa, s1));
+        curIfValid = false;
+        return;
+    }
+    curIfValid = true;
+    curIfAddr = ifa;
+    curIfIdx = ifidx;
 }
 
-void k_join(struct IfDesc *ifd, uint32_t grp) {
+/*
+ * Joins or leaves the group on the interface with socket 'fd', or only
+ * the channel ('src', 'grp') if 'src' is set. Where the system has no
+ * source filter API, the whole group is joined or left instead. Returns
+ * 0, or the error of the system.
+ */
+static int k_membership_sockopt(int fd, struct IfDesc *ifd, uint32_t grp, uint32_t src, int join) {
+    int rc;
+
+#if defined(MCAST_JOIN_SOURCE_GROUP)
+    if (src != 0) {
+        struct group_source_req gsr;
+        struct sockaddr_in *sin;
+
+        memset(&gsr, 0, sizeof(gsr));
+        gsr.gsr_interface = ifd->ifIndex;
+        sin = (struct sockaddr_in *)&gsr.gsr_group;
+        sin->sin_family = AF_INET;
+#ifdef HAVE_STRUCT_SOCKADDR_SA_LEN
+        sin->sin_len = sizeof(*sin);
+#endif
+        sin->sin_addr.s_addr = grp;
+        sin = (struct sockaddr_in *)&gsr.gsr_source;
+        sin->sin_family = AF_INET;
+#ifdef HAVE_STRUCT_SOCKADDR_SA_LEN
+        sin->sin_len = sizeof(*sin);
+#endif
+        sin->sin_addr.s_addr = src;
+
+        rc = setsockopt(fd, IPPROTO_IP, join ? MCAST_JOIN_SOURCE_GROUP : MCAST_LEAVE_SOURCE_GROUP,
+                        (char *)&gsr, sizeof(gsr));
+        return rc < 0 ? errno : 0;
+    }
+#endif
+    {
 #ifdef HAVE_STRUCT_IP_MREQN
-    struct ip_mreqn mreq;
-    mreq.imr_address.s_addr = ifd->InAdr.s_addr;
-    mreq.imr_ifindex = ifd->ifIndex;
+        struct ip_mreqn mreq;
+        mreq.imr_address.s_addr = ifd->InAdr.s_addr;
+        mreq.imr_ifindex = ifd->ifIndex;
 #else
-    struct ip_mreq mreq;
-    mreq.imr_interface.s_addr = ifd->InAdr.s_addr;
+        struct ip_mreq mreq;
+        mreq.imr_interface.s_addr = ifd->InAdr.s_addr;
 #endif
-    mreq.imr_multiaddr.s_addr = grp;
+        mreq.imr_multiaddr.s_addr = grp;
 
-    my_log(LOG_NOTICE, 0, "Joining group %s on interface %s", inetFmt(grp, s1), ifd->Name);
+        rc = setsockopt(fd, IPPROTO_IP, join ? IP_ADD_MEMBERSHIP : IP_DROP_MEMBERSHIP,
+                        (char *)&mreq, sizeof(mreq));
+        return rc < 0 ? errno : 0;
+    }
+}
 
-    if (setsockopt(MRouterFD, IPPROTO_IP, IP_ADD_MEMBERSHIP,
-                   (char *)&mreq, sizeof(mreq)) < 0) {
-        int mcastGroupExceeded = (errno == ENOBUFS);
-        my_log(LOG_WARNING, errno, "can't join group %s on interface %s",
-            inetFmt(grp, s1), ifd->Name);
-        if (mcastGroupExceeded) {
-            my_log(LOG_WARNING, 0, "Maximum number of multicast groups were exceeded");
-#ifdef __linux__
-            my_log(LOG_WARNING, 0, "Check settings of '/sbin/sysctl net.ipv4.igmp_max_memberships'");
-#endif
+/*
+ * The system limits the memberships of a socket, ae. with the sysctl
+ * net.ipv4.igmp_max_memberships on Linux. The memberships are therefore
+ * spread over a pool of sockets that only hold memberships. A socket is
+ * used until a join on it fails with ENOBUFS, and a new one is opened
+ * when all are full. The socket of each membership is kept in a hash.
+ */
+struct MemberSock {
+    int             fd;
+    unsigned        count;          // Memberships held.
+    unsigned        limit;          // Count a join failed at, 0 if none did.
+};
+
+struct Membership {
+    uint32_t        group;
+    uint32_t        source;         // 0 for the whole group.
+    struct IfDesc   *ifd;           // Stays in place, unlike its ifindex.
+    unsigned        sock;           // Index in member_socks.
+};
+
+static struct MemberSock    *member_socks;
+static unsigned             member_sock_count, member_sock_size;
+static unsigned             member_sock_hint;   // No room in the sockets before.
+
+// Hash index of the memberships, keyed by group, source and interface.
+#define MEMBER_HASH_MINSIZE 64
+static struct Hash          member_hash;
+static struct Pool          member_pool;
+static unsigned long        member_full;
+
+static inline uint32_t memberHashValue(uint32_t group, uint32_t source, struct IfDesc *ifd) {
+    return hashMix(hashCombine(hashCombine(source, group), (uint32_t)(uintptr_t)ifd));
+}
+
+static uint32_t memberHashKey(const void *entry) {
+    const struct Membership *m = (const struct Membership *)entry;
+
+    return memberHashValue(m->group, m->source, m->ifd);
+}
+
+static struct Membership *memberHashFind(uint32_t group, uint32_t source, struct IfDesc *ifd) {
+    struct Membership *m;
+    unsigned slot;
+
+    if (member_hash.slots == NULL) {
+        poolInit(&member_pool, "membership", sizeof(struct Membership));
+        hashInit(&member_hash, "membership", MEMBER_HASH_MINSIZE, memberHashKey);
+    }
+    for (slot = hashSlot(&member_hash, memberHashValue(group, source, ifd));
+         (m = member_hash.slots[slot]); slot = hashNext(&member_hash, slot)) {
+        if (m->group == group && m->source == source && m->ifd == ifd) {
+            return m;
         }
     }
+    return NULL;
 }
 
-void k_leave(struct IfDesc *ifd, uint32_t grp) {
-#ifdef HAVE_STRUCT_IP_MREQN
-    struct ip_mreqn mreq;
-    mreq.imr_address.s_addr = ifd->InAdr.s_addr;
-    mreq.imr_ifindex = ifd->ifIndex;
-#else
-    struct ip_mreq mreq;
-    mreq.imr_interface.s_addr = ifd->InAdr.s_addr;
-#endif
-    mreq.imr_multiaddr.s_addr = grp;
+/*
+ * Opens another membership socket. Returns 0 if it can not be opened.
+ */
+static int memberSockOpen(void) {
+    struct MemberSock *socks;
+    int fd;
+
+    if (member_sock_count == member_sock_size) {
+        unsigned size = member_sock_size ? 2 * member_sock_size : 4;
+
+        socks = (struct MemberSock *)realloc(member_socks, size * sizeof(*socks));
+        if (socks == NULL) {
+            my_log(LOG_WARNING, 0, "Out of memory. No membership socket added.");
+            return 0;
+        }
+        member_socks = socks;
+        member_sock_size = size;
+    }
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        my_log(LOG_WARNING, errno, "can't open membership socket");
+        return 0;
+    }
+    member_socks[member_sock_count].fd = fd;
+    member_socks[member_sock_count].count = 0;
+    member_socks[member_sock_count].limit = 0;
+    member_sock_count++;
+
+    my_log(LOG_DEBUG, 0, "Opened membership socket %u", member_sock_count);
+    return 1;
+}
 
+/*
+ * Joins the group, or the channel ('src', 'grp') if 'src' is set, on the
+ * interface, on the first membership socket with room.
+ */
+static void k_member_join(struct IfDesc *ifd, uint32_t grp, uint32_t src) {
+    struct Membership *m;
+    struct MemberSock *ms;
+    unsigned sock;
+    int err;
+
+    if (memberHashFind(grp, src, ifd) != NULL) {
+        return;
+    }
+
+    for (sock = member_sock_hint; ; sock++) {
+        if (sock == member_sock_count && !memberSockOpen()) {
+            return;
+        }
+        ms = &member_socks[sock];
+        if (ms->limit != 0 && ms->count >= ms->limit) {
+            continue;
+        }
+
+        err = k_membership_sockopt(ms->fd, ifd, grp, src, 1);
+        if (err == 0) {
+            break;
+        }
+        if (err != ENOBUFS || ms->count == 0) {
+            my_log(LOG_WARNING, err, "can't join group %s (source %s) on interface %s",
+                inetFmt(grp, s1), inetFmt(src, s2), ifd->Name);
+            return;
+        }
+
+        // The socket is full, go on with the next one.
+        ms->limit = ms->count;
+        member_full++;
+        my_log(LOG_INFO, 0, "Membership socket %u is full with %u memberships.",
+            sock + 1, ms->count);
+    }
+    member_sock_hint = sock;
+
+    m = (struct Membership *)poolAlloc(&member_pool);
+    if (m == NULL) {
+        my_log(LOG_WARNING, 0, "Out of memory. Membership of %s is not tracked.",
+            inetFmt(grp, s1));
+        k_membership_sockopt(ms->fd, ifd, grp, src, 0);
+        return;
+    }
+    m->group = grp;
+    m->source = src;
+    m->ifd = ifd;
+    m->sock = sock;
+    ms->count++;
+
+    hashInsert(&member_hash, m);
+}
+
+/*
+ * Leaves the group, or the channel ('src', 'grp') if 'src' is set, on the
+ * interface, on the membership socket that joined it.
+ */
+static void k_member_leave(struct IfDesc *ifd, uint32_t grp, uint32_t src) {
+    struct Membership *m;
+    int err;
+
+    m = memberHashFind(grp, src, ifd);
+    if (m == NULL) {
+        my_log(LOG_DEBUG, 0, "Group %s (source %s) is not joined on interface %s",
+            inetFmt(grp, s1), inetFmt(src, s2), ifd->Name);
+        return;
+    }
+    hashRemove(&member_hash, m);
+
+    err = k_membership_sockopt(member_socks[m->sock].fd, ifd, grp, src, 0);
+    if (err != 0) {
+        my_log(LOG_WARNING, err, "can't leave group %s (source %s) on interface %s",
+            inetFmt(grp, s1), inetFmt(src, s2), ifd->Name);
+    }
+    member_socks[m->sock].count--;
+    if (m->sock < member_sock_hint) {
+        member_sock_hint = m->sock;
+    }
+    poolFree(&member_pool, m);
+}
+
+void k_join(struct IfDesc *ifd, uint32_t grp) {
+    my_log(LOG_NOTICE, 0, "Joining group %s on interface %s", inetFmt(grp, s1), ifd->Name);
+    k_member_join(ifd, grp, 0);
+}
+
+void k_leave(struct IfDesc *ifd, uint32_t grp) {
     my_log(LOG_NOTICE, 0, "Leaving group %s on interface %s", inetFmt(grp, s1), ifd->Name);
+    k_member_leave(ifd, grp, 0);
+}
 
-    if (setsockopt(MRouterFD, IPPROTO_IP, IP_DROP_MEMBERSHIP,
-                   (char *)&mreq, sizeof(mreq)) < 0)
-        my_log(LOG_WARNING, errno, "can't leave group %s on interface %s",
-            inetFmt(grp, s1), ifd->Name);
+void k_join_source(struct IfDesc *ifd, uint32_t grp, uint32_t src) {
+    my_log(LOG_NOTICE, 0, "Joining channel (%s, %s) on interface %s",
+        inetFmt(src, s1), inetFmt(grp, s2), ifd->Name);
+    k_member_join(ifd, grp, src);
+}
+
+void k_leave_source(struct IfDesc *ifd, uint32_t grp, uint32_t src) {
+    my_log(LOG_NOTICE, 0, "Leaving channel (%s, %s) on interface %s",
+        inetFmt(src, s1), inetFmt(grp, s2), ifd->Name);
+    k_member_leave(ifd, grp, src);
+}
+
+/*
+ * Writes the membership statistics to 'fp', or to the log if 'fp' is NULL.
+ */
+void kernDumpStats(FILE *fp) {
+    statsLine(fp, "kern.membership.sockets %u", member_sock_count);
+    statsLine(fp, "kern.membership.count %u", member_hash.count);
+    statsLine(fp, "kern.membership.full %lu", member_full);
+}
+
+/*
+ * Returns the MTU of the interface, or the least MTU of IPv4 if the
+ * system does not tell.
+ */
+unsigned k_if_mtu(struct IfDesc *ifd) {
+    struct ifreq ifr;
+
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifd->Name);
+    if (ioctl(MRouterFD, SIOCGIFMTU, &ifr) < 0) {
+        my_log(LOG_WARNING, errno, "ioctl SIOCGIFMTU for %s", ifd->Name);
+        return 576;
+    }
+    return ifr.ifr_mtu < 576 ? 576 : (unsigned)ifr.ifr_mtu;
 }
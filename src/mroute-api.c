@@ -47,11 +47,50 @@ char        *recv_buf;          /* input packet buffer         */
 char        *send_buf;          /* output packet buffer        */
 
 
+// Traffic counters of a VIF, sampled with 'statsinterval'.
+struct VifCount {
+    unsigned long   ipkts, opkts, ibytes, obytes;
+    unsigned long   ipktRate, opktRate, ibyteRate, obyteRate;
+    uint64_t        sampled;        // Monotonic time in ms, 0 if never.
+};
+
 // my internal virtual interfaces descriptor vector
 static struct VifDesc {
     struct IfDesc *IfDp;
+    struct VifCount Count;
 } VifDescVc[ MAXVIFS ];
 
+// Next VIF to sample.
+static unsigned     VifPollIx;
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+/*
+** With the netlink backend the MFC entries are queued as RTM_NEWROUTE and
+** RTM_DELROUTE messages of the RTNL_FAMILY_IPMR family, and sent to the
+** kernel in one batch by flushMRoutes().
+*/
+#define NL_BATCH_SIZE   32768
+#define NL_BATCH_MAX    64
+
+static int          NetlinkFD = -1;
+static uint32_t     nlSeq;
+static char         nlBuf[ NL_BATCH_SIZE ];
+static unsigned     nlLen;
+
+// The queued entries, for reporting the acknowledgments.
+static struct {
+    uint32_t        seq;
+    int             type;
+    struct in_addr  OriginAdr, McAdr;
+} nlPending[ NL_BATCH_MAX ];
+static unsigned     nlCount;
+
+static unsigned long nlBatches, nlEntries, nlErrors;
+#endif
+
 /*
 ** Initialises the mrouted API and locks it by this exclusively.
 **
@@ -69,6 +108,28 @@ int enableMRouter(void)
                      (void *)&Va, sizeof( Va ) ) )
         return errno;
 
+#ifdef HAVE_LINUX_RTNETLINK_H
+    if ( getCommonConfig()->mfcNetlink ) {
+        struct sockaddr_nl sa;
+
+        if ( (NetlinkFD = socket( AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE )) < 0 )
+            my_log( LOG_ERR, errno, "RTNETLINK socket open" );
+
+        memset( &sa, 0, sizeof( sa ) );
+        sa.nl_family = AF_NETLINK;
+        if ( bind( NetlinkFD, (struct sockaddr *)&sa, sizeof( sa ) ) < 0 )
+            my_log( LOG_ERR, errno, "RTNETLINK bind" );
+
+#ifdef NETLINK_CAP_ACK
+        // Errors need not echo the whole request.
+        setsockopt( NetlinkFD, SOL_NETLINK, NETLINK_CAP_ACK, &Va, sizeof( Va ) );
+#endif
+
+        // The queued entries are sent after each round of the event loop.
+        event_addHook( flushMRoutes );
+    }
+#endif
+
     return 0;
 }
 
@@ -78,6 +139,15 @@ int enableMRouter(void)
 */
 void disableMRouter(void)
 {
+    flushMRoutes();
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+    if ( NetlinkFD >= 0 ) {
+        close( NetlinkFD );
+        NetlinkFD = -1;
+    }
+#endif
+
     if ( setsockopt( MRouterFD, IPPROTO_IP, MRT_DONE, NULL, 0 ) < 0 )
         my_log( LOG_WARNING, errno, "MRT_DONE" );
 
@@ -97,6 +167,9 @@ void delVIF( struct IfDesc *IfDp )
     if ((unsigned int)-1 == IfDp->index)
         return;
 
+    // Queued entries refer to the VIFs as they are now.
+    flushMRoutes();
+
     VifCtl.vifc_vifi = IfDp->index;
 
     my_log( LOG_NOTICE, 0, "removing VIF, Ix %d Fl 0x%x IP 0x%08x %s, Threshold: %d, Ratelimit: %d",
@@ -105,6 +178,9 @@ void delVIF( struct IfDesc *IfDp )
     if ( setsockopt( MRouterFD, IPPROTO_IP, MRT_DEL_VIF,
                      (char *)&VifCtl, sizeof( VifCtl ) ) )
         my_log( LOG_WARNING, errno, "MRT_DEL_VIF" );
+
+    // The kernel routes must be written again with the new VIF set.
+    invalidateKernelRoutes();
 }
 
 /*
@@ -116,6 +192,9 @@ void addVIF( struct IfDesc *IfDp )
     struct vifctl VifCtl;
     struct VifDesc *VifDp;
 
+    // Queued entries refer to the VIFs as they are now.
+    flushMRoutes();
+
     /* search free (aimwang: or exist) VifDesc
      */
     for ( VifDp = VifDescVc; VifDp < VCEP( VifDescVc ); VifDp++ ) {
@@ -128,6 +207,9 @@ void addVIF( struct IfDesc *IfDp )
     if ( VifDp >= VCEP( VifDescVc ) )
         my_log( LOG_ERR, ENOMEM, "addVIF, out of VIF space" );
 
+    // The kernel counters of a new VIF start from zero.
+    if ( VifDp->IfDp != IfDp )
+        memset( &VifDp->Count, 0, sizeof( VifDp->Count ) );
     VifDp->IfDp = IfDp;
 
     VifCtl.vifc_vifi  = VifDp - VifDescVc;
@@ -162,10 +244,270 @@ void addVIF( struct IfDesc *IfDp )
                      (char *)&VifCtl, sizeof( VifCtl ) ) )
         my_log( LOG_ERR, errno, "MRT_ADD_VIF" );
 
+    // The kernel routes must be written again with the new VIF set.
+    invalidateKernelRoutes();
+}
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+/*
+** Appends the attribute 'type' with 'len' bytes of 'data' to the queued
+** message 'nlh'.
+*/
+static struct rtattr *addAttr( struct nlmsghdr *nlh, int type, const void *data, int len )
+{
+    struct rtattr *rta = (struct rtattr *)((char *)nlh + NLMSG_ALIGN( nlh->nlmsg_len ));
+
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH( len );
+    if ( data )
+        memcpy( RTA_DATA( rta ), data, len );
+    nlh->nlmsg_len = NLMSG_ALIGN( nlh->nlmsg_len ) + RTA_ALIGN( rta->rta_len );
+    return rta;
+}
+
+/*
+** Queues the MFC entry '*Dp' as a netlink message of 'type'. The entry
+** is sent by the next flushMRoutes().
+*/
+static void queueMRoute( int type, struct MRouteDesc *Dp )
+{
+    struct nlmsghdr *nlh;
+    struct rtmsg *rtm;
+    struct rtattr *mp;
+    struct rtnexthop *rtnh;
+    uint32_t table = RT_TABLE_DEFAULT;
+    uint32_t iif = 0;
+    int Ix, last = -1;
+
+    // Worst case size of the message: all VIFs as next hops.
+    if ( nlLen + NLMSG_SPACE( sizeof( *rtm ) ) + 4 * RTA_SPACE( 4 ) +
+         RTA_SPACE( MAXVIFS * RTNH_ALIGN( sizeof( *rtnh ) ) ) > sizeof( nlBuf ) ||
+         nlCount == NL_BATCH_MAX )
+        flushMRoutes();
+
+    if ( Dp->InVif >= 0 && Dp->InVif < MAXVIFS && VifDescVc[ Dp->InVif ].IfDp )
+        iif = VifDescVc[ Dp->InVif ].IfDp->ifIndex;
+
+    nlh = (struct nlmsghdr *)(nlBuf + nlLen);
+    memset( nlh, 0, NLMSG_SPACE( sizeof( *rtm ) ) );
+    nlh->nlmsg_len = NLMSG_LENGTH( sizeof( *rtm ) );
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    if ( type == RTM_NEWROUTE )
+        nlh->nlmsg_flags |= NLM_F_CREATE | NLM_F_REPLACE;
+    nlh->nlmsg_seq = ++nlSeq;
+
+    rtm = NLMSG_DATA( nlh );
+    rtm->rtm_family = RTNL_FAMILY_IPMR;
+    rtm->rtm_dst_len = 32;
+    rtm->rtm_src_len = Dp->OriginAdr.s_addr ? 32 : 0;
+    rtm->rtm_table = RT_TABLE_DEFAULT;
+    rtm->rtm_protocol = RTPROT_MROUTED;
+    rtm->rtm_scope = RT_SCOPE_UNIVERSE;
+    rtm->rtm_type = RTN_MULTICAST;
+
+    addAttr( nlh, RTA_TABLE, &table, sizeof( table ) );
+    addAttr( nlh, RTA_SRC, &Dp->OriginAdr.s_addr, 4 );
+    addAttr( nlh, RTA_DST, &Dp->McAdr.s_addr, 4 );
+    addAttr( nlh, RTA_IIF, &iif, sizeof( iif ) );
+
+    // The kernel takes the TTL of VIF n from the n'th next hop.
+    for ( Ix = 0; Ix < MAXVIFS; Ix++ )
+        if ( Dp->TtlVc[ Ix ] )
+            last = Ix;
+    if ( type == RTM_NEWROUTE && last >= 0 ) {
+        mp = addAttr( nlh, RTA_MULTIPATH, NULL, 0 );
+        for ( Ix = 0; Ix <= last; Ix++ ) {
+            rtnh = (struct rtnexthop *)((char *)nlh + nlh->nlmsg_len);
+            memset( rtnh, 0, sizeof( *rtnh ) );
+            rtnh->rtnh_len = sizeof( *rtnh );
+            rtnh->rtnh_hops = Dp->TtlVc[ Ix ];
+            rtnh->rtnh_ifindex = VifDescVc[ Ix ].IfDp ? VifDescVc[ Ix ].IfDp->ifIndex : 0;
+            nlh->nlmsg_len += RTNH_ALIGN( sizeof( *rtnh ) );
+        }
+        mp->rta_len = (char *)nlh + nlh->nlmsg_len - (char *)mp;
+    }
+
+    nlPending[ nlCount ].seq = nlh->nlmsg_seq;
+    nlPending[ nlCount ].type = type;
+    nlPending[ nlCount ].OriginAdr = Dp->OriginAdr;
+    nlPending[ nlCount ].McAdr = Dp->McAdr;
+    nlCount++;
+    nlLen += NLMSG_ALIGN( nlh->nlmsg_len );
+}
+
+/*
+** Reports the acknowledgment of a queued entry.
+*/
+static void ackMRoute( uint32_t seq, int error )
+{
+    char FmtBuO[ 32 ], FmtBuM[ 32 ];
+    unsigned i;
+
+    for ( i = 0; i < nlCount; i++ )
+        if ( nlPending[ i ].seq == seq )
+            break;
+    if ( i == nlCount )
+        return;
+
+    if ( error ) {
+        nlErrors++;
+        my_log( LOG_WARNING, error, "%s %s -> %s",
+             nlPending[ i ].type == RTM_NEWROUTE ? "RTM_NEWROUTE" : "RTM_DELROUTE",
+             fmtInAdr( FmtBuO, nlPending[ i ].OriginAdr ),
+             fmtInAdr( FmtBuM, nlPending[ i ].McAdr ) );
+
+        // Write every route again on the next update, the shadow of the
+        // failed entry is wrong now.
+        if ( nlPending[ i ].type == RTM_NEWROUTE )
+            invalidateKernelRoutes();
+    } else {
+        my_log( LOG_DEBUG, 0, "%s %s -> %s acknowledged",
+             nlPending[ i ].type == RTM_NEWROUTE ? "RTM_NEWROUTE" : "RTM_DELROUTE",
+             fmtInAdr( FmtBuO, nlPending[ i ].OriginAdr ),
+             fmtInAdr( FmtBuM, nlPending[ i ].McAdr ) );
+    }
+}
+#endif
+
+/*
+** Sends the MFC entries queued for the netlink backend to the kernel,
+** and reads the acknowledgments.
+*/
+void flushMRoutes( void )
+{
+#ifdef HAVE_LINUX_RTNETLINK_H
+    struct sockaddr_nl sa;
+    struct nlmsghdr *nlh;
+    char buf[ 8192 ];
+    unsigned acked = 0;
+    int len;
+
+    if ( nlCount == 0 )
+        return;
+
+    memset( &sa, 0, sizeof( sa ) );
+    sa.nl_family = AF_NETLINK;
+    nlBatches++;
+    nlEntries += nlCount;
+
+    if ( sendto( NetlinkFD, nlBuf, nlLen, 0, (struct sockaddr *)&sa, sizeof( sa ) ) < 0 ) {
+        my_log( LOG_WARNING, errno, "RTNETLINK send of %u MFC entries", nlCount );
+        nlErrors += nlCount;
+        invalidateKernelRoutes();
+        nlLen = nlCount = 0;
+        return;
+    }
+
+    // The kernel has handled the whole batch once the send returns.
+    while ( acked < nlCount ) {
+        len = recv( NetlinkFD, buf, sizeof( buf ), MSG_DONTWAIT );
+        if ( len < 0 ) {
+            if ( errno == EINTR )
+                continue;
+            if ( errno != EAGAIN && errno != EWOULDBLOCK )
+                my_log( LOG_WARNING, errno, "RTNETLINK recv" );
+            break;
+        }
+        for ( nlh = (struct nlmsghdr *)buf; NLMSG_OK( nlh, (unsigned)len ); nlh = NLMSG_NEXT( nlh, len ) ) {
+            if ( nlh->nlmsg_type == NLMSG_ERROR ) {
+                struct nlmsgerr *err = NLMSG_DATA( nlh );
+                ackMRoute( nlh->nlmsg_seq, -err->error );
+                acked++;
+            }
+        }
+    }
+
+    if ( acked < nlCount )
+        my_log( LOG_WARNING, 0, "Missing RTNETLINK acknowledgments for %u MFC entries", nlCount - acked );
+
+    nlLen = nlCount = 0;
+#endif
+}
+
+/*
+** Samples the kernel counters of the next 'Count' VIFs, and computes
+** their rates since the previous sample.
+*/
+void pollVifCounters( unsigned Count )
+{
+    struct sioc_vif_req VifReq;
+    struct VifCount *Cnt;
+    struct timespec Now;
+    uint64_t NowMs, Elapsed;
+
+    clock_gettime( CLOCK_MONOTONIC, &Now );
+    NowMs = (uint64_t)Now.tv_sec * 1000 + Now.tv_nsec / 1000000;
+
+    for ( ; Count > 0; Count--, VifPollIx = (VifPollIx + 1) % MAXVIFS ) {
+        if ( ! VifDescVc[ VifPollIx ].IfDp )
+            continue;
+
+        memset( &VifReq, 0, sizeof( VifReq ) );
+        VifReq.vifi = VifPollIx;
+        if ( ioctl( MRouterFD, SIOCGETVIFCNT, (char *)&VifReq ) < 0 ) {
+            my_log( LOG_DEBUG, errno, "SIOCGETVIFCNT for VIF %u", VifPollIx );
+            continue;
+        }
+
+        Cnt = &VifDescVc[ VifPollIx ].Count;
+        Elapsed = NowMs - Cnt->sampled;
+        if ( Cnt->sampled && Elapsed > 0 && VifReq.icount >= Cnt->ipkts &&
+             VifReq.ocount >= Cnt->opkts && VifReq.ibytes >= Cnt->ibytes &&
+             VifReq.obytes >= Cnt->obytes ) {
+            Cnt->ipktRate  = (VifReq.icount - Cnt->ipkts) * 1000 / Elapsed;
+            Cnt->opktRate  = (VifReq.ocount - Cnt->opkts) * 1000 / Elapsed;
+            Cnt->ibyteRate = (VifReq.ibytes - Cnt->ibytes) * 1000 / Elapsed;
+            Cnt->obyteRate = (VifReq.obytes - Cnt->obytes) * 1000 / Elapsed;
+        }
+        Cnt->ipkts   = VifReq.icount;
+        Cnt->opkts   = VifReq.ocount;
+        Cnt->ibytes  = VifReq.ibytes;
+        Cnt->obytes  = VifReq.obytes;
+        Cnt->sampled = NowMs;
+    }
+}
+
+/*
+** Writes the statistics of the netlink backend and the VIF counters to
+** 'fp', or to the log if 'fp' is NULL.
+*/
+void mrouteDumpStats( FILE *fp )
+{
+    struct VifDesc *VifDp;
+
+    for ( VifDp = VifDescVc; VifDp < VCEP( VifDescVc ); VifDp++ ) {
+        const char *Name;
+        struct VifCount *Cnt = &VifDp->Count;
+
+        if ( ! VifDp->IfDp || ! Cnt->sampled )
+            continue;
+
+        Name = VifDp->IfDp->Name;
+        statsLine( fp, "vif.%s.in.pkts %lu", Name, Cnt->ipkts );
+        statsLine( fp, "vif.%s.in.bytes %lu", Name, Cnt->ibytes );
+        statsLine( fp, "vif.%s.in.pktrate %lu", Name, Cnt->ipktRate );
+        statsLine( fp, "vif.%s.in.byterate %lu", Name, Cnt->ibyteRate );
+        statsLine( fp, "vif.%s.out.pkts %lu", Name, Cnt->opkts );
+        statsLine( fp, "vif.%s.out.bytes %lu", Name, Cnt->obytes );
+        statsLine( fp, "vif.%s.out.pktrate %lu", Name, Cnt->opktRate );
+        statsLine( fp, "vif.%s.out.byterate %lu", Name, Cnt->obyteRate );
+    }
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+    if ( NetlinkFD < 0 )
+        return;
+
+    statsLine( fp, "mroute.netlink.batches %lu", nlBatches );
+    statsLine( fp, "mroute.netlink.entries %lu", nlEntries );
+    statsLine( fp, "mroute.netlink.errors %lu", nlErrors );
+#endif
 }
 
 /*
-** Adds the multicast routed '*Dp' to the kernel routes
+** Adds the multicast routed '*Dp' to the kernel routes. With the netlink
+** backend the entry is only queued, and errors are reported when the
+** queue is flushed.
 **
 ** returns: - 0 if the function succeeds
 **          - the errno value for non-fatal failure condition
@@ -194,6 +536,24 @@ int addMRoute( struct MRouteDesc *Dp )
            );
     }
 
+#ifdef HAVE_LINUX_RTNETLINK_H
+    if ( NetlinkFD >= 0 ) {
+        queueMRoute( RTM_NEWROUTE, Dp );
+        return 0;
+    }
+#endif
+
+#ifdef MRT_ADD_MFC_PROXY
+    // A (*,G) entry forwards from all sources.
+    if ( CtlReq.mfcc_origin.s_addr == INADDR_ANY ) {
+        rc = setsockopt( MRouterFD, IPPROTO_IP, MRT_ADD_MFC_PROXY,
+                        (void *)&CtlReq, sizeof( CtlReq ) );
+        if (rc)
+            my_log( LOG_WARNING, errno, "MRT_ADD_MFC_PROXY" );
+        return rc;
+    }
+#endif
+
     rc = setsockopt( MRouterFD, IPPROTO_IP, MRT_ADD_MFC,
                     (void *)&CtlReq, sizeof( CtlReq ) );
     if (rc)
@@ -203,7 +563,31 @@ int addMRoute( struct MRouteDesc *Dp )
 }
 
 /*
-** Removes the multicast routed '*Dp' from the kernel routes
+** Reads the packet and byte counters of the kernel route '*Dp' into
+** '*PktCnt' and '*ByteCnt'.
+**
+** returns: - 0 if the function succeeds
+**          - the errno value if the kernel has no such route
+*/
+int getMRouteCount( struct MRouteDesc *Dp, unsigned long *PktCnt, unsigned long *ByteCnt )
+{
+    struct sioc_sg_req SgReq;
+
+    memset( &SgReq, 0, sizeof( SgReq ) );
+    SgReq.src = Dp->OriginAdr;
+    SgReq.grp = Dp->McAdr;
+
+    if ( ioctl( MRouterFD, SIOCGETSGCNT, (char *)&SgReq ) < 0 )
+        return errno;
+
+    *PktCnt = SgReq.pktcnt;
+    *ByteCnt = SgReq.bytecnt;
+    return 0;
+}
+
+/*
+** Removes the multicast routed '*Dp' from the kernel routes. With the
+** netlink backend the removal is only queued.
 **
 ** returns: - 0 if the function succeeds
 **          - the errno value for non-fatal failure condition
@@ -231,6 +615,23 @@ int delMRoute( struct MRouteDesc *Dp )
            );
     }
 
+#ifdef HAVE_LINUX_RTNETLINK_H
+    if ( NetlinkFD >= 0 ) {
+        queueMRoute( RTM_DELROUTE, Dp );
+        return 0;
+    }
+#endif
+
+#ifdef MRT_DEL_MFC_PROXY
+    if ( CtlReq.mfcc_origin.s_addr == INADDR_ANY ) {
+        rc = setsockopt( MRouterFD, IPPROTO_IP, MRT_DEL_MFC_PROXY,
+                        (void *)&CtlReq, sizeof( CtlReq ) );
+        if (rc)
+            my_log( LOG_WARNING, errno, "MRT_DEL_MFC_PROXY" );
+        return rc;
+    }
+#endif
+
     rc = setsockopt( MRouterFD, IPPROTO_IP, MRT_DEL_MFC,
                     (void *)&CtlReq, sizeof( CtlReq ) );
     if (rc)
@@ -0,0 +1 @@
+../src/os-linux.h
\ No newline at end of file
@@ -0,0 +1,319 @@
+/*
+**  igmpproxy - IGMP proxy based multicast router
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+/**
+*   pacing.c - Paced changes of the upstream memberships.
+*
+*   Upstream routers police IGMP, and drop part of the reports when many
+*   groups are joined at once. With 'upstreamrate', the joins and leaves
+*   of the upstream memberships are queued and carried out at most at the
+*   configured rate, with bursts of up to 'upstreamburst' changes, by a
+*   token bucket. Leaves go first, so that bandwidth is freed before it is
+*   used again. The changes are queued per downstream VIF that caused them,
+*   and the VIFs take turns, so that one VIF joining many groups does not
+*   hold up the others. A change that is undone while it waits is dropped
+*   together with the change undoing it.
+*/
+
+#include "igmpproxy.h"
+#include "igmpv3.h"
+
+struct PacedChange {
+    struct PacedChange  *next;          // Next change in the queue.
+    struct PacedChange  **pprev;        // Link pointing to this change.
+    uint32_t            group;
+    uint32_t            source;         // 0 for the whole group.
+    uint64_t            queued;         // Time queued, in ms.
+    short               ups;            // Upstream index.
+    short               queue;          // Queue index, the VIF or MAXVIFS.
+    bool                join;
+};
+
+struct PaceQueue {
+    struct PacedChange  *head;
+    struct PacedChange  **tail;
+};
+
+// Leave and join queues of the VIFs, and of the changes without a VIF.
+#define PACE_QUEUES     (MAXVIFS + 1)
+static struct PaceQueue     paceQueues[2][PACE_QUEUES];
+static unsigned             paceNext[2];        // Queue to take the next turn.
+static unsigned             paceCount[2];       // Changes in the queues.
+
+// Hash index of the queued changes, keyed by upstream, group and source.
+#define PACE_HASH_MINSIZE   64
+static struct Hash          pace_hash;
+static struct Pool          pace_pool;
+
+// Token bucket, in thousandths of a change.
+static uint64_t             paceTokens, paceMaxTokens, paceStamp;
+static timer_h              paceTimer;
+
+static unsigned long pace_queued, pace_sent, pace_cancelled;
+static uint64_t      pace_wait_total, pace_wait_max;
+
+static void paceRun(void *arg);
+
+static uint64_t paceClock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline uint32_t paceHashValue(int ups, uint32_t group, uint32_t source) {
+    return hashMix(hashCombine(hashCombine(source, group), (uint32_t)ups));
+}
+
+static uint32_t paceHashKey(const void *entry) {
+    const struct PacedChange *pc = (const struct PacedChange *)entry;
+
+    return paceHashValue(pc->ups, pc->group, pc->source);
+}
+
+static struct PacedChange *paceHashFind(int ups, uint32_t group, uint32_t source) {
+    struct PacedChange *pc;
+    unsigned slot;
+
+    for (slot = hashSlot(&pace_hash, paceHashValue(ups, group, source));
+         (pc = pace_hash.slots[slot]); slot = hashNext(&pace_hash, slot)) {
+        if (pc->ups == ups && pc->group == group && pc->source == source) {
+            return pc;
+        }
+    }
+    return NULL;
+}
+
+/**
+*   Carries out a change of the upstream membership on upstream 'ups'.
+*   With 'upstreamreports' the proxy reports the change itself, instead
+*   of the kernel.
+*/
+static void applyMembership(int ups, uint32_t group, uint32_t source, int join) {
+    struct IfDesc *upstrIf;
+
+    if (getCommonConfig()->upstreamReports) {
+        if (source != 0) {
+            reportChange(ups, group, join ? IGMPV3_ALLOW_NEW_SOURCES :
+                IGMPV3_BLOCK_OLD_SOURCES, source);
+        } else {
+            reportChange(ups, group, join ? IGMPV3_CHANGE_TO_EXCLUDE :
+                IGMPV3_CHANGE_TO_INCLUDE, 0);
+        }
+        return;
+    }
+
+    upstrIf = upStreamIfIdx[ups] != -1 ? getIfByIx(upStreamIfIdx[ups]) : NULL;
+    if (upstrIf == NULL) {
+        my_log(LOG_WARNING, 0, "Upstream %d is gone. Change of %s dropped.",
+            ups, inetFmt(group, s1));
+    } else if (source != 0) {
+        if (join) {
+            k_join_source(upstrIf, group, source);
+        } else {
+            k_leave_source(upstrIf, group, source);
+        }
+    } else {
+        if (join) {
+            k_join(upstrIf, group);
+        } else {
+            k_leave(upstrIf, group);
+        }
+    }
+}
+
+/**
+*   Unlinks and releases a queued change.
+*/
+static void paceRelease(struct PacedChange *pc) {
+    struct PaceQueue *q = &paceQueues[pc->join][pc->queue];
+
+    hashRemove(&pace_hash, pc);
+    *pc->pprev = pc->next;
+    if (pc->next != NULL) {
+        pc->next->pprev = pc->pprev;
+    } else {
+        q->tail = pc->pprev;
+    }
+    paceCount[pc->join]--;
+    poolFree(&pace_pool, pc);
+}
+
+/**
+*   Initializes the pacing of the upstream changes.
+*/
+void initPacing(void) {
+    struct Config *conf = getCommonConfig();
+    unsigned i, q;
+
+    poolInit(&pace_pool, "pacedchange", sizeof(struct PacedChange));
+    hashInit(&pace_hash, "pacedchange", PACE_HASH_MINSIZE, paceHashKey);
+    for (i = 0; i < 2; i++) {
+        for (q = 0; q < PACE_QUEUES; q++) {
+            paceQueues[i][q].head = NULL;
+            paceQueues[i][q].tail = &paceQueues[i][q].head;
+        }
+    }
+
+    // The bucket starts full.
+    paceMaxTokens = (uint64_t)conf->upstreamBurst * 1000;
+    paceTokens = paceMaxTokens;
+    paceStamp = paceClock();
+}
+
+/**
+*   Joins or leaves the group, or the source 'source' of it if that is
+*   set, on upstream 'ups'. The change is paced if 'upstreamrate' is set,
+*   and queued for the VIF 'vif' that caused it, or -1 if none did.
+*/
+void paceMembership(int ups, uint32_t group, uint32_t source, int join, int vif) {
+    struct PacedChange  *pc;
+    struct PaceQueue    *q;
+
+    if (getCommonConfig()->upstreamRate == 0) {
+        applyMembership(ups, group, source, join);
+        return;
+    }
+
+    // A change undone while it waits is not carried out at all.
+    pc = paceHashFind(ups, group, source);
+    if (pc != NULL) {
+        if (pc->join != (join != 0)) {
+            paceRelease(pc);
+            pace_cancelled++;
+        }
+        return;
+    }
+
+    pc = (struct PacedChange *)poolAlloc(&pace_pool);
+    if (pc == NULL) {
+        my_log(LOG_WARNING, 0, "Out of memory. Change of %s not paced.", inetFmt(group, s1));
+        applyMembership(ups, group, source, join);
+        return;
+    }
+    pc->group = group;
+    pc->source = source;
+    pc->ups = ups;
+    pc->join = join != 0;
+    pc->queue = vif >= 0 && vif < MAXVIFS ? vif : MAXVIFS;
+    pc->queued = paceClock();
+
+    hashInsert(&pace_hash, pc);
+
+    q = &paceQueues[pc->join][pc->queue];
+    pc->next = NULL;
+    pc->pprev = q->tail;
+    *q->tail = pc;
+    q->tail = &pc->next;
+    paceCount[pc->join]++;
+    pace_queued++;
+
+    if (timer_leftTimer(paceTimer) < 0) {
+        paceRun(NULL);
+    }
+}
+
+/**
+*   Takes the next change off the queues. Leaves go before joins, and
+*   the queues of the VIFs take turns.
+*/
+static struct PacedChange *paceNextChange(void) {
+    unsigned kind, i, q;
+
+    for (kind = 0; kind < 2; kind++) {
+        if (paceCount[kind] == 0) {
+            continue;
+        }
+        for (i = 0; i < PACE_QUEUES; i++) {
+            q = (paceNext[kind] + i) % PACE_QUEUES;
+            if (paceQueues[kind][q].head != NULL) {
+                paceNext[kind] = (q + 1) % PACE_QUEUES;
+                return paceQueues[kind][q].head;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+*   Carries out the queued changes the bucket has tokens for, and waits
+*   for the next token if changes are left.
+*/
+static void paceRun(void *arg) {
+    struct Config       *conf = getCommonConfig();
+    struct PacedChange  *pc;
+    uint64_t            now = paceClock(), wait;
+
+    (void)arg;
+
+    // Refill the bucket for the time passed.
+    paceTokens += (now - paceStamp) * conf->upstreamRate;
+    if (paceTokens > paceMaxTokens) {
+        paceTokens = paceMaxTokens;
+    }
+    paceStamp = now;
+
+    while (paceTokens >= 1000 && (pc = paceNextChange()) != NULL) {
+        paceTokens -= 1000;
+        wait = now - pc->queued;
+        pace_wait_total += wait;
+        if (wait > pace_wait_max) {
+            pace_wait_max = wait;
+        }
+        pace_sent++;
+        applyMembership(pc->ups, pc->group, pc->source, pc->join);
+        paceRelease(pc);
+    }
+
+    if (paceCount[0] + paceCount[1] > 0) {
+        paceTimer = timer_setTimer((1000 - paceTokens + conf->upstreamRate - 1) /
+            conf->upstreamRate, paceRun, NULL);
+    }
+}
+
+/**
+*   Carries out the queued leaves at once, and drops the queued joins.
+*   Used on exit, after the groups were left. A join still queued then
+*   was never made, and must not be made after the leave.
+*/
+void flushPacing(void) {
+    struct PacedChange *pc;
+
+    timer_clearTimer(paceTimer);
+    while ((pc = paceNextChange()) != NULL) {
+        if (!pc->join) {
+            applyMembership(pc->ups, pc->group, pc->source, 0);
+        }
+        paceRelease(pc);
+    }
+}
+
+/**
+*   Writes the pacing statistics to 'fp', or to the log if 'fp' is NULL.
+*/
+void pacingDumpStats(FILE *fp) {
+    statsLine(fp, "pacing.queue.leaves %u", paceCount[0]);
+    statsLine(fp, "pacing.queue.joins %u", paceCount[1]);
+    statsLine(fp, "pacing.queued %lu", pace_queued);
+    statsLine(fp, "pacing.sent %lu", pace_sent);
+    statsLine(fp, "pacing.cancelled %lu", pace_cancelled);
+    statsLine(fp, "pacing.wait.avg_ms %lu",
+        pace_sent ? (unsigned long)(pace_wait_total / pace_sent) : 0UL);
+    statsLine(fp, "pacing.wait.max_ms %lu", (unsigned long)pace_wait_max);
+}
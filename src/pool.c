@@ -0,0 +1,164 @@
+/*
+**  igmpproxy - IGMP proxy based multicast router
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+*   pool.c - Fixed size object pools.
+*
+*   Objects of one type are carved out of larger slabs, and released
+*   objects are kept on a free list for reuse. Slabs are only returned
+*   to the system when the whole pool is destroyed, so the hot paths
+*   never go through malloc() and free().
+*/
+
+#include "igmpproxy.h"
+
+// Approximate number of bytes allocated per slab.
+#define POOL_SLAB_BYTES     16384
+
+struct PoolSlab {
+    struct PoolSlab     *next;
+};
+
+// All initialized pools, for the statistics dump.
+static struct Pool      *pools;
+
+/**
+*   Initializes a pool of objects with the given size. The number of
+*   objects per slab is derived from the object size.
+*/
+void poolInit(struct Pool *pool, const char *name, size_t size) {
+    struct Pool *p;
+
+    // Round the size up, so that all objects in a slab are aligned.
+    size = (size + sizeof(void *) * 2 - 1) & ~(sizeof(void *) * 2 - 1);
+
+    pool->name      = name;
+    pool->size      = size;
+    pool->perSlab   = size < POOL_SLAB_BYTES ? POOL_SLAB_BYTES / size : 1;
+    pool->freeList  = NULL;
+    pool->slabs     = NULL;
+    pool->total     = 0;
+    pool->inUse     = 0;
+    pool->highWater = 0;
+    pool->allocs    = 0;
+    pool->failed    = 0;
+
+    for (p = pools; p; p = p->next) {
+        if (p == pool) {
+            return;
+        }
+    }
+    pool->next = pools;
+    pools = pool;
+}
+
+/**
+*   Allocates a new slab for the pool, and puts its objects
+*   on the free list.
+*/
+static int poolGrow(struct Pool *pool) {
+    struct PoolSlab *slab;
+    char            *obj;
+    unsigned        i;
+
+    slab = (struct PoolSlab *)malloc(sizeof(void *) * 2 + pool->perSlab * pool->size);
+    if (slab == NULL) {
+        return 0;
+    }
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    obj = (char *)slab + sizeof(void *) * 2;
+    for (i = 0; i < pool->perSlab; i++, obj += pool->size) {
+        *(void **)obj = pool->freeList;
+        pool->freeList = obj;
+    }
+    pool->total += pool->perSlab;
+
+    my_log(LOG_DEBUG, 0, "Pool %s grown to %u objects of %u bytes",
+        pool->name, pool->total, (unsigned)pool->size);
+
+    return 1;
+}
+
+/**
+*   Returns an uninitialized object from the pool, or NULL
+*   if no memory is available.
+*/
+void *poolAlloc(struct Pool *pool) {
+    void *obj;
+
+    if (pool->freeList == NULL && !poolGrow(pool)) {
+        pool->failed++;
+        return NULL;
+    }
+
+    obj = pool->freeList;
+    pool->freeList = *(void **)obj;
+
+    pool->allocs++;
+    if (++pool->inUse > pool->highWater) {
+        pool->highWater = pool->inUse;
+    }
+
+    return obj;
+}
+
+/**
+*   Returns an object to the pool it was allocated from.
+*/
+void poolFree(struct Pool *pool, void *obj) {
+    if (obj == NULL) {
+        return;
+    }
+    *(void **)obj = pool->freeList;
+    pool->freeList = obj;
+    pool->inUse--;
+}
+
+/**
+*   Releases all memory held by the pool. All objects
+*   allocated from the pool become invalid.
+*/
+void poolDestroy(struct Pool *pool) {
+    struct PoolSlab *slab;
+
+    while ((slab = pool->slabs)) {
+        pool->slabs = slab->next;
+        free(slab);
+    }
+    pool->freeList = NULL;
+    pool->total = 0;
+    pool->inUse = 0;
+}
+
+/**
+*   Writes usage statistics of all pools.
+*/
+void poolDumpStats(FILE *fp) {
+    struct Pool *p;
+
+    for (p = pools; p; p = p->next) {
+        statsLine(fp, "pool.%s.objsize %u", p->name, (unsigned)p->size);
+        statsLine(fp, "pool.%s.total %u", p->name, p->total);
+        statsLine(fp, "pool.%s.inuse %u", p->name, p->inUse);
+        statsLine(fp, "pool.%s.highwater %u", p->name, p->highWater);
+        statsLine(fp, "pool.%s.allocs %lu", p->name, p->allocs);
+        statsLine(fp, "pool.%s.failed %lu", p->name, p->failed);
+    }
+}
@@ -0,0 +1,474 @@
+/*
+**  igmpproxy - IGMP proxy based multicast router
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+/**
+*   reports.c - IGMPv3 reports sent by the proxy on the upstream interfaces.
+*
+*   With 'upstreamreports' the kernel is not asked to join the groups on
+*   the upstream interfaces, and the proxy acts as the host itself. Changes
+*   of the upstream memberships are queued as group records, and sent
+*   [robustness] times in IGMPv3 reports that each hold as many records as
+*   fit in the MTU. Queries from the upstream routers are answered with the
+*   current state of the groups, in reports spread over the max response
+*   time of the query. While an IGMPv1 or v2 querier is present upstream,
+*   a report or leave per group is sent instead.
+*/
+
+#include "igmpproxy.h"
+#include "igmpv3.h"
+
+// Interval between the transmissions of a state change, RFC 3376 8.11.
+#define UNSOLICITED_REPORT_INTERVAL 1000
+// State changes made at once are collected this many ms before sending.
+#define REPORT_DELAY                10
+// The most sources a record is built from at once.
+#define REPORT_MAX_SOURCES          (RECV_BUF_SIZE / sizeof(uint32_t))
+
+struct ReportChange {
+    struct ReportChange *next;
+    uint32_t            group;
+    uint32_t            source;         // 0 for changes of the whole group.
+    uint8_t             type;           // Group record type.
+    uint8_t             count;          // Transmissions left.
+};
+
+// Reporting state of an upstream interface.
+struct UpstreamReports {
+    struct ReportChange *changes;       // State changes to send, oldest first.
+    struct ReportChange **last;
+    struct Hash         pending;        // The changes by group and source.
+    timer_h             changeTimer;
+
+    uint32_t            *answer;        // Groups to tell the state of.
+    unsigned            answerCount;
+    unsigned            answerNext;
+    int                 answerGeneral;  // Answering a general query.
+    unsigned            answerInterval; // Milliseconds between the reports.
+    timer_h             answerTimer;
+
+    unsigned            mtu;
+    int                 version;        // Oldest querier version present.
+    time_t              versionUntil;   // When the older querier times out.
+};
+
+// Report being built in the send buffer.
+struct ReportPacket {
+    struct IfDesc       *Dp;
+    int                 version;
+    unsigned            max;            // Bytes of records that fit.
+    unsigned            len;            // Bytes of records added.
+    unsigned            nrec;
+    unsigned            sent;           // Packets sent so far.
+};
+
+static struct UpstreamReports   upsReports[MAX_UPS_VIFS];
+static struct Pool              change_pool;
+static uint32_t                 recordSources[REPORT_MAX_SOURCES];
+
+static unsigned long report_changes, report_records, report_packets, report_queries;
+
+static void sendChanges(void *arg);
+
+static inline uint32_t changeHashValue(uint32_t group, uint32_t source) {
+    return hashMix(hashCombine(source, group));
+}
+
+static uint32_t changeHashKey(const void *data) {
+    const struct ReportChange *rc = (const struct ReportChange *)data;
+
+    return changeHashValue(rc->group, rc->source);
+}
+
+static struct ReportChange *changeHashFind(struct UpstreamReports *ur, uint32_t group,
+                                           uint32_t source) {
+    struct ReportChange *rc;
+    unsigned slot;
+
+    for (slot = hashSlot(&ur->pending, changeHashValue(group, source));
+         (rc = ur->pending.slots[slot]); slot = hashNext(&ur->pending, slot)) {
+        if (rc->group == group && rc->source == source) {
+            return rc;
+        }
+    }
+    return NULL;
+}
+
+/**
+*   Initializes the reporting state of the upstream interfaces.
+*/
+void initReports(void) {
+    int i;
+
+    poolInit(&change_pool, "reportchange", sizeof(struct ReportChange));
+    for (i = 0; i < MAX_UPS_VIFS; i++) {
+        memset(&upsReports[i], 0, sizeof(upsReports[i]));
+        upsReports[i].last = &upsReports[i].changes;
+        hashInit(&upsReports[i].pending, "reportchange", 16, changeHashKey);
+        upsReports[i].version = 3;
+    }
+}
+
+/**
+*   Starts a report on upstream 'ups'. Returns 0 if the interface can not
+*   send any.
+*/
+static int startPacket(struct ReportPacket *pkt, int ups) {
+    struct UpstreamReports *ur = &upsReports[ups];
+
+    pkt->Dp = upStreamIfIdx[ups] != -1 ? getIfByIx(upStreamIfIdx[ups]) : NULL;
+    if (pkt->Dp == NULL || pkt->Dp->InAdr.s_addr == 0) {
+        return 0;
+    }
+    if (ur->mtu == 0) {
+        ur->mtu = k_if_mtu(pkt->Dp);
+    }
+
+    // The older querier is gone when it has not queried for a while.
+    if (ur->version < 3 && time(NULL) >= ur->versionUntil) {
+        my_log(LOG_INFO, 0, "No IGMPv%d querier on %s any more.", ur->version, pkt->Dp->Name);
+        ur->version = 3;
+    }
+    pkt->version = ur->version;
+    pkt->max = (ur->mtu < RECV_BUF_SIZE ? ur->mtu : RECV_BUF_SIZE) -
+        IP_HEADER_RAOPT_LEN - IGMP_MINLEN;
+    pkt->len = 0;
+    pkt->nrec = 0;
+    pkt->sent = 0;
+    return 1;
+}
+
+/**
+*   Sends the records added to the report, if any.
+*/
+static void flushPacket(struct ReportPacket *pkt) {
+    if (pkt->nrec == 0) {
+        return;
+    }
+    sendIgmp(pkt->Dp->InAdr.s_addr, alligmp3_group, IGMP_V3_MEMBERSHIP_REPORT, 0,
+        htonl(pkt->nrec), pkt->len, pkt->Dp->ifIndex);
+    report_packets++;
+    pkt->sent++;
+    pkt->len = 0;
+    pkt->nrec = 0;
+}
+
+/**
+*   Adds a group record to the report, and sends the report when it is
+*   full. Sources that do not fit go into records of the same type in the
+*   next report. For older queriers, a report or leave of the group is
+*   sent instead, and source changes they can not express are left out.
+*/
+static void packRecord(struct ReportPacket *pkt, uint32_t group, int type,
+                       unsigned nsrcs, const uint32_t *sources) {
+    struct igmpv3_grec  *grec;
+    uint32_t            src = pkt->Dp->InAdr.s_addr;
+    unsigned            n;
+
+    report_records++;
+    if (pkt->version < 3) {
+        if (type == IGMPV3_BLOCK_OLD_SOURCES) {
+            return;
+        }
+        if (nsrcs == 0 && (type == IGMPV3_CHANGE_TO_INCLUDE || type == IGMPV3_MODE_IS_INCLUDE)) {
+            if (pkt->version == 2) {
+                sendIgmp(src, allrouters_group, IGMP_V2_LEAVE_GROUP, 0, group, 0, pkt->Dp->ifIndex);
+            }
+        } else {
+            sendIgmp(src, group, pkt->version == 1 ? IGMP_V1_MEMBERSHIP_REPORT :
+                IGMP_V2_MEMBERSHIP_REPORT, 0, group, 0, pkt->Dp->ifIndex);
+        }
+        report_packets++;
+        pkt->sent++;
+        return;
+    }
+
+    do {
+        if (pkt->len + sizeof(*grec) + (nsrcs > 0 ? sizeof(uint32_t) : 0) > pkt->max) {
+            flushPacket(pkt);
+        }
+        grec = (struct igmpv3_grec *)(send_buf + IP_HEADER_RAOPT_LEN + IGMP_MINLEN + pkt->len);
+        n = (pkt->max - pkt->len - sizeof(*grec)) / sizeof(uint32_t);
+        if (n > nsrcs) {
+            n = nsrcs;
+        }
+        grec->grec_type = type;
+        grec->grec_auxwords = 0;
+        grec->grec_nsrcs = htons(n);
+        grec->grec_mca.s_addr = group;
+        memcpy(grec->grec_src, sources, n * sizeof(uint32_t));
+        pkt->len += sizeof(*grec) + n * sizeof(uint32_t);
+        pkt->nrec++;
+        sources += n;
+        nsrcs -= n;
+    } while (nsrcs > 0);
+}
+
+/**
+*   Queues a change of the membership of the group, or of the source
+*   'source' of it, on upstream 'ups'. 'type' is the group record type
+*   telling the change. The changes made at once are sent together. A
+*   change still queued for the same group and source is replaced, so
+*   that only the current state is sent again, RFC 3376 5.1.
+*/
+void reportChange(int ups, uint32_t group, int type, uint32_t source) {
+    struct UpstreamReports  *ur = &upsReports[ups];
+    struct ReportChange     *rc;
+    int                     left;
+
+    if ((rc = changeHashFind(ur, group, source)) == NULL) {
+        rc = (struct ReportChange *)poolAlloc(&change_pool);
+        if (rc == NULL) {
+            my_log(LOG_WARNING, 0, "Out of memory. Change of %s not reported.",
+                inetFmt(group, s1));
+            return;
+        }
+        rc->next = NULL;
+        rc->group = group;
+        rc->source = source;
+        *ur->last = rc;
+        ur->last = &rc->next;
+        hashInsert(&ur->pending, rc);
+    }
+    rc->type = type;
+    rc->count = getCommonConfig()->robustnessValue;
+    report_changes++;
+
+    my_log(LOG_DEBUG, 0, "Reporting change %d of %s (source %s) on upstream %d",
+        type, inetFmt(group, s1), inetFmt(source, s2), ups);
+
+    // Send soon, also when only a retransmission was due.
+    left = timer_leftTimer(ur->changeTimer);
+    if (left < 0 || left > REPORT_DELAY) {
+        timer_clearTimer(ur->changeTimer);
+        ur->changeTimer = timer_setTimer(REPORT_DELAY, sendChanges, ur);
+    }
+}
+
+/**
+*   Sends the queued state changes of an upstream. Source changes of the
+*   same kind for a group go into one record. The changes that were sent
+*   often enough are dropped, and the others are sent again later.
+*/
+static void sendChanges(void *arg) {
+    struct UpstreamReports  *ur = (struct UpstreamReports *)arg;
+    struct ReportChange     *rc, **prc;
+    struct ReportPacket     pkt;
+    uint32_t                group;
+    unsigned                n;
+    int                     type;
+
+    if (startPacket(&pkt, ur - upsReports)) {
+        sendIgmpBatch();
+        for (rc = ur->changes; rc != NULL; ) {
+            group = rc->group;
+            type = rc->type;
+            n = 0;
+            do {
+                if (rc->source != 0) {
+                    recordSources[n++] = rc->source;
+                }
+                rc = rc->next;
+            } while (rc != NULL && n > 0 && n < REPORT_MAX_SOURCES && rc->source != 0 &&
+                     rc->group == group && rc->type == type);
+            packRecord(&pkt, group, type, n, recordSources);
+        }
+        flushPacket(&pkt);
+        sendIgmpFlush();
+    }
+
+    for (prc = &ur->changes; (rc = *prc) != NULL; ) {
+        if (--rc->count == 0) {
+            *prc = rc->next;
+            hashRemove(&ur->pending, rc);
+            poolFree(&change_pool, rc);
+        } else {
+            prc = &rc->next;
+        }
+    }
+    ur->last = prc;
+
+    if (ur->changes != NULL) {
+        ur->changeTimer = timer_setTimer(UNSOLICITED_REPORT_INTERVAL, sendChanges, ur);
+    }
+}
+
+/**
+*   Sends the pending state changes of all upstreams once, and forgets
+*   them. Used on exit, after the groups were left.
+*/
+void flushReports(void) {
+    struct ReportChange *rc;
+    int i;
+
+    for (i = 0; i < MAX_UPS_VIFS; i++) {
+        timer_clearTimer(upsReports[i].changeTimer);
+        for (rc = upsReports[i].changes; rc != NULL; rc = rc->next) {
+            rc->count = 1;
+        }
+        if (upsReports[i].changes != NULL) {
+            sendChanges(&upsReports[i]);
+        }
+        free(upsReports[i].answer);
+        upsReports[i].answer = NULL;
+    }
+}
+
+/**
+*   Sends the next report of the answer to a query, with the current
+*   state of the groups still to answer for.
+*/
+static void sendAnswer(void *arg) {
+    struct UpstreamReports  *ur = (struct UpstreamReports *)arg;
+    struct ReportPacket     pkt;
+    int                     type, nsrcs;
+
+    if (!startPacket(&pkt, ur - upsReports)) {
+        ur->answerNext = ur->answerCount;
+        pkt.nrec = 0;
+    }
+
+    sendIgmpBatch();
+    while (ur->answerNext < ur->answerCount) {
+        type = getUpstreamState(ur->answer[ur->answerNext], ur - upsReports,
+            recordSources, REPORT_MAX_SOURCES, &nsrcs);
+
+        // The rest goes into the next report.
+        if (pkt.sent > 0 || (pkt.nrec > 0 &&
+            pkt.len + sizeof(struct igmpv3_grec) + nsrcs * sizeof(uint32_t) > pkt.max)) {
+            break;
+        }
+        if (type != 0) {
+            packRecord(&pkt, ur->answer[ur->answerNext], type, nsrcs, recordSources);
+        }
+        ur->answerNext++;
+    }
+    flushPacket(&pkt);
+    sendIgmpFlush();
+
+    if (ur->answerNext < ur->answerCount) {
+        ur->answerTimer = timer_setTimer(ur->answerInterval, sendAnswer, ur);
+    } else {
+        free(ur->answer);
+        ur->answer = NULL;
+        ur->answerCount = ur->answerNext = 0;
+        ur->answerGeneral = 0;
+    }
+}
+
+/**
+*   Returns the max response time of a query in milliseconds.
+*/
+static unsigned queryMaxResp(int version, int code) {
+    if (version == 1) {
+        return 10000;
+    }
+    if (version == 3 && code >= 128) {
+        code = ((code & 0x0f) | 0x10) << (((code >> 4) & 0x07) + 3);
+    }
+    return code * 100;
+}
+
+/**
+*   Handles a query of 'version' from 'src', with the max response code
+*   'code'. Queries received on an upstream interface are answered with
+*   the state of the queried group, or of all groups joined upstream.
+*/
+void acceptUpstreamQuery(uint32_t src, uint32_t group, int version, int code, int ifindex) {
+    struct Config           *conf = getCommonConfig();
+    struct UpstreamReports  *ur;
+    struct IfDesc           *Dp = NULL;
+    unsigned                maxResp, packets, i;
+    int                     ups;
+
+    // Find the upstream interface the query was received on.
+    for (ups = 0; ups < MAX_UPS_VIFS && upStreamIfIdx[ups] != -1; ups++) {
+        Dp = getIfByIx(upStreamIfIdx[ups]);
+        if (Dp != NULL && (ifindex > 0 ? Dp->ifIndex == ifindex : isAdressValidForIf(Dp, src))) {
+            break;
+        }
+    }
+    if (ups == MAX_UPS_VIFS || upStreamIfIdx[ups] == -1 || src == Dp->InAdr.s_addr) {
+        return;
+    }
+    ur = &upsReports[ups];
+    report_queries++;
+
+    maxResp = queryMaxResp(version, code);
+    if (maxResp == 0) {
+        maxResp = 1;
+    }
+
+    // Answer in the version of the oldest querier.
+    if (version < 3) {
+        if (version < ur->version || time(NULL) >= ur->versionUntil) {
+            my_log(LOG_INFO, 0, "IGMPv%d querier %s on %s.", version, inetFmt(src, s1), Dp->Name);
+            ur->version = version;
+        }
+        ur->versionUntil = time(NULL) + conf->robustnessValue * conf->queryInterval + maxResp / 1000;
+    }
+
+    if (group == 0) {
+        // A general query is answered with the state of all groups.
+        if (ur->answerGeneral) {
+            return;
+        }
+        timer_clearTimer(ur->answerTimer);
+        free(ur->answer);
+        ur->answer = getUpstreamGroups(ups, &ur->answerCount);
+        ur->answerNext = 0;
+        ur->answerGeneral = 1;
+        ur->mtu = k_if_mtu(Dp);
+
+        // Spread the reports over the max response time.
+        if (ur->version < 3) {
+            packets = ur->answerCount;
+        } else {
+            packets = ur->answerCount * sizeof(struct igmpv3_grec) /
+                (ur->mtu - IP_HEADER_RAOPT_LEN - IGMP_MINLEN);
+        }
+        ur->answerInterval = maxResp / (packets + 1);
+        ur->answerTimer = timer_setTimer(rand() % (ur->answerInterval + 1), sendAnswer, ur);
+    } else if (!ur->answerGeneral && IN_MULTICAST(ntohl(group))) {
+        // Group specific queries add the group to the pending answer.
+        for (i = ur->answerNext; i < ur->answerCount; i++) {
+            if (ur->answer[i] == group) {
+                return;
+            }
+        }
+        ur->answer = (uint32_t *)realloc(ur->answer, (ur->answerCount + 1) * sizeof(uint32_t));
+        if (ur->answer == NULL) {
+            my_log(LOG_ERR, 0, "Out of memory.");
+        }
+        ur->answer[ur->answerCount++] = group;
+        if (timer_leftTimer(ur->answerTimer) < 0) {
+            ur->answerInterval = maxResp;
+            ur->answerTimer = timer_setTimer(rand() % maxResp, sendAnswer, ur);
+        }
+    }
+}
+
+/**
+*   Writes the report statistics to 'fp', or to the log if 'fp' is NULL.
+*/
+void reportsDumpStats(FILE *fp) {
+    statsLine(fp, "reports.changes %lu", report_changes);
+    statsLine(fp, "reports.records %lu", report_records);
+    statsLine(fp, "reports.packets %lu", report_packets);
+    statsLine(fp, "reports.queries %lu", report_queries);
+}
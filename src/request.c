@@ -39,22 +39,165 @@
 */
 
 #include "igmpproxy.h"
+#include "igmpv3.h"
 
 // Prototypes...
 void sendGroupSpecificMemberQuery(void *argument);
 
 typedef struct {
-    uint32_t      group;
-    // uint32_t      vifAddr;
-    short       started;
+    uint32_t        group;
+    struct IfDesc   *Dp;            // Interface the leave was received on.
+    short           rounds;         // Queries left to send.
 } GroupVifDesc;
 
+// Pool of last member query descriptors.
+static struct Pool  gvdesc_pool;
+
+// Hash index of the running last member query cycles, keyed by group
+// and interface, so that there is only one per pair.
+#define GVDESC_HASH_MINSIZE 64
+static struct Hash  gvdesc_hash;
+
+static unsigned long lmq_started, lmq_joined, lmq_restarted, lmq_expired;
+
+// The interface is keyed by its descriptor, which stays in place when
+// the interface is refreshed, unlike its ifindex.
+static inline uint32_t gvDescHashValue(uint32_t group, struct IfDesc *Dp) {
+    return hashMix(hashCombine(group, (uint32_t)(uintptr_t)Dp));
+}
+
+static uint32_t gvDescHashKey(const void *entry) {
+    const GroupVifDesc *gvDesc = (const GroupVifDesc *)entry;
+
+    return gvDescHashValue(gvDesc->group, gvDesc->Dp);
+}
+
+static GroupVifDesc *gvDescFind(uint32_t group, struct IfDesc *Dp) {
+    GroupVifDesc *gvDesc;
+    unsigned slot;
+
+    for (slot = hashSlot(&gvdesc_hash, gvDescHashValue(group, Dp));
+         (gvDesc = gvdesc_hash.slots[slot]); slot = hashNext(&gvdesc_hash, slot)) {
+        if (gvDesc->group == group && gvDesc->Dp == Dp) {
+            return gvDesc;
+        }
+    }
+    return NULL;
+}
+
+/**
+*   Ends a last member query cycle, and releases its descriptor.
+*/
+static void gvDescRelease(GroupVifDesc *gvDesc) {
+    hashRemove(&gvdesc_hash, gvDesc);
+    poolFree(&gvdesc_pool, gvDesc);
+}
+
+/**
+*   Initializes the request handling.
+*/
+void initRequest(void) {
+    poolInit(&gvdesc_pool, "lastmember", sizeof(GroupVifDesc));
+    hashInit(&gvdesc_hash, "lastmember", GVDESC_HASH_MINSIZE, gvDescHashKey);
+}
+
+
+/**
+*   Converts an interval in milliseconds to an IGMP max response
+*   code, which is in tenths of a second.
+*/
+static int responseCode(unsigned int ms) {
+    unsigned int code = (ms * IGMP_TIMER_SCALE + 999) / 1000;
+
+    return code < 1 ? 1 : code > 255 ? 255 : (int)code;
+}
+
+/**
+*   Finds the interface a report or leave from 'src' was received on.
+*   The interface is known from 'ifindex' if the kernel told it, else
+*   it is looked up from the allowed nets of the interfaces.
+*/
+static struct IfDesc *getSourceVif(uint32_t src, int ifindex) {
+    struct IfDesc  *sourceVif;
+
+    if (ifindex <= 0)
+        return getIfByAddress(src);
+
+    sourceVif = getIfByIfIndex(ifindex);
+    if (sourceVif == NULL) {
+        my_log(LOG_DEBUG, 0, "No interface found for ifindex %d", ifindex);
+        return NULL;
+    }
+
+    // IGMPv3 reports may be sent before the host has an address.
+    if (getCommonConfig()->checkSubnets && src != INADDR_ANY &&
+        !isAdressValidForIf(sourceVif, src)) {
+        my_log(LOG_DEBUG, 0, "The source address %s is not in any allowed net of %s",
+            inetFmt(src, s1), sourceVif->Name);
+        return NULL;
+    }
+    return sourceVif;
+}
+
+/**
+*   Returns the last member query cycle of the group on 'Dp', and sets
+*   'running' if it runs already. A new cycle is allocated, but not
+*   started yet. Returns NULL when out of memory.
+*/
+static GroupVifDesc *lastMemberDesc(uint32_t group, struct IfDesc *Dp, int *running) {
+    GroupVifDesc   *gvDesc = gvDescFind(group, Dp);
+
+    *running = gvDesc != NULL;
+    if (gvDesc == NULL) {
+        gvDesc = (GroupVifDesc*) poolAlloc(&gvdesc_pool);
+    }
+    return gvDesc;
+}
+
+/**
+*   Starts the last member query cycle 'gvDesc' of the group on 'Dp' if
+*   the route table has 'marked' the group, or some of its sources, for
+*   the check. A running cycle goes on, unless a member has answered it
+*   since, so that it was no longer 'checking'. Then it starts over.
+*/
+static void lastMemberQuery(GroupVifDesc *gvDesc, uint32_t group, struct IfDesc *Dp,
+                            int checking, int running, int marked) {
+    if (!marked) {
+        if (!running) {
+            poolFree(&gvdesc_pool, gvDesc);
+        }
+        return;
+    }
+
+    if (running) {
+        if (checking) {
+            // The running cycle goes on.
+            lmq_joined++;
+        } else {
+            // A member answered the cycle, so check again from the start.
+            gvDesc->rounds = getCommonConfig()->lastMemberQueryCount;
+            lmq_restarted++;
+        }
+        my_log(LOG_DEBUG, 0, "Last member query for %s on %s is running already.",
+            inetFmt(group, s1), Dp->Name);
+        return;
+    }
+
+    // Call the group spesific membership querier...
+    gvDesc->group = group;
+    gvDesc->Dp = Dp;
+    gvDesc->rounds = getCommonConfig()->lastMemberQueryCount;
+    hashInsert(&gvdesc_hash, gvDesc);
+    lmq_started++;
+
+    sendGroupSpecificMemberQuery(gvDesc);
+}
 
 /**
 *   Handles incoming membership reports, and
 *   appends them to the routing table.
 */
-void acceptGroupReport(uint32_t src, uint32_t group) {
+void acceptGroupReport(uint32_t src, uint32_t group, int ifindex) {
     struct IfDesc  *sourceVif;
 
     // Sanitycheck the group adress...
@@ -65,7 +208,7 @@ void acceptGroupReport(uint32_t src, uint32_t group) {
     }
 
     // Find the interface on which the report was received.
-    sourceVif = getIfByAddress( src );
+    sourceVif = getSourceVif( src, ifindex );
     if(sourceVif == NULL) {
         my_log(LOG_WARNING, 0, "No interfaces found for source %s",
             inetFmt(src,s1));
@@ -83,28 +226,18 @@ void acceptGroupReport(uint32_t src, uint32_t group) {
         my_log(LOG_DEBUG, 0, "Should insert group %s (from: %s) to route table. Vif Ix : %d",
             inetFmt(group,s1), inetFmt(src,s2), sourceVif->index);
 
-        // If we don't have a black- and whitelist we insertRoute and done
-        if(sourceVif->allowedgroups == NULL)
-        {
-            insertRoute(group, sourceVif->index, src);
-            return;
-        }
-
         // Check if this Request is legit on this interface
-        bool                 allow_list = false;
-        struct SubnetList   *match = NULL;
-        struct SubnetList   *sn;
-
-        for(sn = sourceVif->allowedgroups; sn != NULL; sn = sn->next) {
-            // Check if there is a whitelist
-            if (sn->allow)
-                allow_list = true;
-            if((group & sn->subnet_mask) == sn->subnet_addr)
-                match = sn;
-        }
+        if(groupAclAllows(sourceVif->groupAcl, group)) {
+            const struct in_addr *sources;
+            int nsrcs;
+
+            // Only the mapped sources of SSM mapped groups are wanted.
+            if((nsrcs = lookupSsmMap(group, &sources)) > 0) {
+                updateRouteSources(group, sourceVif->index, src,
+                                   IGMPV3_MODE_IS_INCLUDE, nsrcs, sources);
+                return;
+            }
 
-        if((!allow_list && match == NULL) ||
-          (allow_list && match != NULL && match->allow)) {
             // The membership report was OK... Insert it into the route table..
             insertRoute(group, sourceVif->index, src);
             return;
@@ -117,10 +250,72 @@ void acceptGroupReport(uint32_t src, uint32_t group) {
     }
 }
 
+/**
+*   Handles an IGMPv3 group record of 'type' listing single sources,
+*   and updates the sources of the route. Records that let the members
+*   stop receiving sources start a last member query.
+*/
+void acceptSourceReport(uint32_t src, uint32_t group, int type, int nsrcs,
+                        const struct in_addr *sources, int ifindex) {
+    struct IfDesc  *sourceVif;
+    GroupVifDesc   *gvDesc = NULL;
+    int             checking = 0, running = 0, query, marked;
+
+    // Sanitycheck the group adress...
+    if(!IN_MULTICAST( ntohl(group) )) {
+        my_log(LOG_WARNING, 0, "The group address %s is not a valid Multicast group.",
+            inetFmt(group, s1));
+        return;
+    }
+
+    // Find the interface on which the report was received.
+    sourceVif = getSourceVif( src, ifindex );
+    if(sourceVif == NULL) {
+        my_log(LOG_WARNING, 0, "No interfaces found for source %s",
+            inetFmt(src,s1));
+        return;
+    }
+
+    if(sourceVif->InAdr.s_addr == src) {
+        my_log(LOG_NOTICE, 0, "The IGMP message was from myself. Ignoring.");
+        return;
+    }
+
+    if(sourceVif->state != IF_STATE_DOWNSTREAM) {
+        my_log(LOG_INFO, 0, "Mebership report was received on %s. Ignoring.",
+            sourceVif->state==IF_STATE_UPSTREAM?"the upstream interface":"a disabled interface");
+        return;
+    }
+
+    if(!groupAclAllows(sourceVif->groupAcl, group)) {
+        my_log(LOG_INFO, 0, "The group address %s may not be requested from this interface. Ignoring.", inetFmt(group, s1));
+        return;
+    }
+
+    my_log(LOG_DEBUG, 0, "Should update %d sources of group %s (from: %s). Vif Ix : %d",
+        nsrcs, inetFmt(group,s1), inetFmt(src,s2), sourceVif->index);
+
+    // Only these records may leave sources or the group without members.
+    query = type == IGMPV3_BLOCK_OLD_SOURCES || type == IGMPV3_CHANGE_TO_INCLUDE;
+    if(query) {
+        checking = lastMemberVifCheck(group, sourceVif->index);
+        gvDesc = lastMemberDesc(group, sourceVif, &running);
+        if(gvDesc == NULL) {
+            my_log(LOG_WARNING, 0, "Out of memory. Ignoring source report.");
+            return;
+        }
+    }
+
+    marked = updateRouteSources(group, sourceVif->index, src, type, nsrcs, sources);
+    if(query) {
+        lastMemberQuery(gvDesc, group, sourceVif, checking, running, marked);
+    }
+}
+
 /**
 *   Recieves and handles a group leave message.
 */
-void acceptLeaveMessage(uint32_t src, uint32_t group) {
+void acceptLeaveMessage(uint32_t src, uint32_t group, int ifindex) {
     struct IfDesc   *sourceVif;
 
     my_log(LOG_DEBUG, 0,
@@ -135,7 +330,7 @@ void acceptLeaveMessage(uint32_t src, uint32_t group) {
     }
 
     // Find the interface on which the report was received.
-    sourceVif = getIfByAddress( src );
+    sourceVif = getSourceVif( src, ifindex );
     if(sourceVif == NULL) {
         my_log(LOG_WARNING, 0, "No interfaces found for source %s",
             inetFmt(src,s1));
@@ -146,17 +341,19 @@ void acceptLeaveMessage(uint32_t src, uint32_t group) {
     if(sourceVif->state == IF_STATE_DOWNSTREAM) {
 
         GroupVifDesc   *gvDesc;
-        gvDesc = (GroupVifDesc*) malloc(sizeof(GroupVifDesc));
+        int             checking, running;
 
-        // Tell the route table that we are checking for remaining members...
-        setRouteLastMemberMode(group, src);
-
-        // Call the group spesific membership querier...
-        gvDesc->group = group;
-        // gvDesc->vifAddr = sourceVif->InAdr.s_addr;
-        gvDesc->started = 0;
+        // A cycle may run for the group on the interface already.
+        checking = lastMemberVifCheck(group, sourceVif->index);
+        gvDesc = lastMemberDesc(group, sourceVif, &running);
+        if(gvDesc == NULL) {
+            my_log(LOG_WARNING, 0, "Out of memory. Ignoring leave request.");
+            return;
+        }
 
-        sendGroupSpecificMemberQuery(gvDesc);
+        // Tell the route table that we are checking for remaining members...
+        lastMemberQuery(gvDesc, group, sourceVif, checking, running,
+                        setRouteLastMemberMode(group, sourceVif->index, src));
 
     } else {
         // just ignore the leave request...
@@ -165,55 +362,48 @@ void acceptLeaveMessage(uint32_t src, uint32_t group) {
 }
 
 /**
-*   Sends a group specific member report query until the
-*   group times out...
+*   Sends a group specific member report query on the interface
+*   the leave was received on, until a member answers or the
+*   group times out on the interface...
 */
 void sendGroupSpecificMemberQuery(void *argument) {
     struct  Config  *conf = getCommonConfig();
-    struct  IfDesc  *Dp;
-    int     Ix;
 
     // Cast argument to correct type...
     GroupVifDesc   *gvDesc = (GroupVifDesc*) argument;
+    struct  IfDesc  *Dp = gvDesc->Dp;
 
-    if(gvDesc->started) {
-        // If aging returns false, we don't do any further action...
-        if(!lastMemberGroupAge(gvDesc->group)) {
-            // FIXME: Should we free gvDesc here?
-            return;
-        }
-    } else {
-        gvDesc->started = 1;
+    // If a member has answered, we don't do any further action...
+    if(!lastMemberVifCheck(gvDesc->group, Dp->index)) {
+        gvDescRelease(gvDesc);
+        return;
     }
 
-    /**
-     * FIXME: This loops through all interfaces the group is active on an sends queries.
-     *        It might be better to send only a query on the interface the leave was accepted on and remove only that interface from the route.
-     */
-
-    // Loop through all downstream interfaces
-    for ( Ix = 0; (Dp = getIfByIx(Ix)); Ix++ ) {
-        if ( Dp->InAdr.s_addr && ! (Dp->Flags & IFF_LOOPBACK) ) {
-            if(Dp->state == IF_STATE_DOWNSTREAM) {
-                // Is that interface used in the group?
-                if (interfaceInRoute(gvDesc->group ,Dp->index)) {
-
-                    // Send a group specific membership query...
-                    sendIgmp(Dp->InAdr.s_addr, gvDesc->group,
-                            IGMP_MEMBERSHIP_QUERY,
-                            conf->lastMemberQueryInterval * IGMP_TIMER_SCALE,
-                            gvDesc->group, 0, Dp->ifIndex);
-
-                    my_log(LOG_DEBUG, 0, "Sent membership query from %s to %s. Delay: %d",
-                            inetFmt(Dp->InAdr.s_addr,s1), inetFmt(gvDesc->group,s2),
-                            conf->lastMemberQueryInterval);
-                }
-            }
-        }
+    // No answer to the last query, remove the interface from the group.
+    if(gvDesc->rounds <= 0) {
+        lastMemberVifExpire(gvDesc->group, Dp->index);
+        lmq_expired++;
+        gvDescRelease(gvDesc);
+        return;
+    }
+    gvDesc->rounds--;
+
+    if(Dp->state == IF_STATE_DOWNSTREAM) {
+        // Send a group specific membership query...
+        sendIgmp(Dp->InAdr.s_addr, gvDesc->group,
+                IGMP_MEMBERSHIP_QUERY,
+                responseCode(conf->lastMemberQueryInterval),
+                gvDesc->group, 0, Dp->ifIndex);
+
+        my_log(LOG_DEBUG, 0, "Sent membership query from %s to %s. Delay: %dms",
+                inetFmt(Dp->InAdr.s_addr,s1), inetFmt(gvDesc->group,s2),
+                conf->lastMemberQueryInterval);
     }
 
     // Set timeout for next round...
-    timer_setTimer(conf->lastMemberQueryInterval, sendGroupSpecificMemberQuery, gvDesc);
+    if(timer_setTimer(conf->lastMemberQueryInterval, sendGroupSpecificMemberQuery, gvDesc).node == NULL) {
+        gvDescRelease(gvDesc);
+    }
 }
 
 
@@ -225,17 +415,18 @@ void sendGeneralMembershipQuery(void) {
     struct  IfDesc  *Dp;
     int             Ix;
 
-    // Loop through all downstream vifs...
+    // Loop through all downstream vifs, and send the queries at once.
+    sendIgmpBatch();
     for ( Ix = 0; (Dp = getIfByIx(Ix)); Ix++ ) {
         if ( Dp->InAdr.s_addr && ! (Dp->Flags & IFF_LOOPBACK) ) {
             if(Dp->state == IF_STATE_DOWNSTREAM) {
                 // Send the membership query...
                 sendIgmp(Dp->InAdr.s_addr, allhosts_group,
                          IGMP_MEMBERSHIP_QUERY,
-                         conf->queryResponseInterval * IGMP_TIMER_SCALE, 0, 0, Dp->ifIndex);
+                         responseCode(conf->queryResponseInterval), 0, 0, Dp->ifIndex);
 
                 my_log(LOG_DEBUG, 0,
-                    "Sent membership query from %s ifIndex %d to %s. Delay: %d",
+                    "Sent membership query from %s ifIndex %d to %s. Delay: %dms",
                     inetFmt(Dp->InAdr.s_addr,s1),
                     Dp->ifIndex,
                     inetFmt(allhosts_group,s2),
@@ -243,6 +434,7 @@ void sendGeneralMembershipQuery(void) {
             }
         }
     }
+    sendIgmpFlush();
 
     // Install timer for aging active routes.
     timer_setTimer(conf->queryResponseInterval, (timer_f)ageActiveRoutes, NULL);
@@ -250,12 +442,23 @@ void sendGeneralMembershipQuery(void) {
     // Install timer for next general query...
     if(conf->startupQueryCount>0) {
         // Use quick timer...
-        timer_setTimer(conf->startupQueryInterval, (timer_f)sendGeneralMembershipQuery, NULL);
+        timer_setTimer(conf->startupQueryInterval * 1000, (timer_f)sendGeneralMembershipQuery, NULL);
         // Decrease startup counter...
         conf->startupQueryCount--;
     }
     else {
         // Use slow timer...
-        timer_setTimer(conf->queryInterval, (timer_f)sendGeneralMembershipQuery, NULL);
+        timer_setTimer(conf->queryInterval * 1000, (timer_f)sendGeneralMembershipQuery, NULL);
     }
 }
+
+/**
+*   Writes the request statistics to 'fp', or to the log if 'fp' is NULL.
+*/
+void requestDumpStats(FILE *fp) {
+    statsLine(fp, "lastmember.active %u", gvdesc_hash.count);
+    statsLine(fp, "lastmember.started %lu", lmq_started);
+    statsLine(fp, "lastmember.joined %lu", lmq_joined);
+    statsLine(fp, "lastmember.restarted %lu", lmq_restarted);
+    statsLine(fp, "lastmember.expired %lu", lmq_expired);
+}
@@ -39,89 +39,224 @@
 */
 
 #include "igmpproxy.h"
+#include "igmpv3.h"
 
-#define MAX_ORIGINS 4
+/**
+*   Shadow of a MFC entry installed in the kernel, so that an entry is
+*   only written again when it has changed.
+*/
+struct MfcShadow {
+    short               inVif;          // Input VIF, or -1 if not installed.
+    uint8_t             ttls[MAXVIFS];  // TTL vector.
+};
+
+/**
+*   Kernel counters of an origin, polled when 'sourceidle' is set. The
+*   times are in milliseconds of the poll clock.
+*/
+struct OriginCount {
+    unsigned long       pktCnt;         // Counters at the last poll.
+    unsigned long       byteCnt;
+    unsigned long       pktRate;        // Per second since the poll before.
+    unsigned long       byteRate;
+    uint32_t            polled;         // Time of the last poll.
+    uint32_t            active;         // Time the counters last moved.
+};
+
+/**
+*   A source requested with IGMPv3 by INCLUDE mode members of a group.
+*/
+struct RouteSource {
+    struct RouteSource  *next;
+    uint32_t            addr;
+    uint32_t            vifBits;        // VIFs with members of the source.
+    uint32_t            ageVifBits;     // VIFs that reported it this round.
+    uint32_t            lmqVifBits;     // VIFs checking for members after a block.
+    int                 ageValue;       // Rounds left until unreported VIFs go.
+    short               upstrJoined;    // Joined upstream source specifically.
+};
+
+// Upstream membership held for a route.
+#define UPSTR_NONE          0
+#define UPSTR_ANY           1           // The whole group is joined.
+#define UPSTR_SOURCES       2           // The requested sources are joined.
 
 /**
-*   Routing table structure definition. Double linked list...
+*   Routing table structure definition. The entries are kept in a double
+*   linked list in insertion order, and indexed by group in a hash table.
 */
 struct RouteTable {
-    struct RouteTable   *nextroute;     // Pointer to the next group in line.
-    struct RouteTable   *prevroute;     // Pointer to the previous group in line.
+    struct RouteTable   *nextroute;     // Pointer to the next route in the list.
+    struct RouteTable   *prevroute;     // Pointer to the previous route in the list.
     uint32_t            group;          // The group to route
     uint32_t            originAddrs[MAX_ORIGINS]; // The origin adresses (only set on activated routes)
+    struct MfcShadow    mfc[MAX_ORIGINS]; // Kernel entries of the origins.
+    struct OriginCount  count[MAX_ORIGINS]; // Traffic of the origins.
+    struct MfcShadow    anyMfc;         // Kernel (*,G) entry, with 'proxymfc'.
     uint32_t            vifBits;        // Bits representing recieving VIFs.
+    uint32_t            lmqVifBits;     // VIFs in the last member check.
+    uint32_t            inclVifBits;    // VIFs that only want the listed sources.
+    struct RouteSource  *sources;       // Sources of the INCLUDE mode VIFs.
 
     // Keeps the upstream membership state...
     short               upstrState;     // Upstream membership state.
+    short               upstrMode;      // Upstream membership held.
     int                 upstrVif;       // Upstream Vif Index.
+    short               reportVif;      // VIF of the latest change, or -1.
+    uint8_t             upstrAclChecked; // Upstreams the group lists were checked for.
+    uint8_t             upstrAclAllowed; // Upstreams the group may be joined on.
 
     // These parameters contain aging details.
     uint32_t            ageVifBits;     // Bits representing aging VIFs.
     int                 ageValue;       // Downcounter for death.
     int                 ageActivity;    // Records any acitivity that notes there are still listeners.
 
-    // Keeps downstream hosts information
-    uint32_t            downstreamHostsHashSeed;
-    uint8_t             downstreamHostsHashTable[];
+    // Keeps downstream hosts information, with 'quickleave'.
+    struct HostSet      hosts;
 };
 
 
 // Keeper for the routing table...
 static struct RouteTable   *routing_table;
 
+// Hash index of the routing table, keyed by group.
+#define ROUTE_HASH_MINSIZE  64
+static struct Hash          route_hash;
+
+// Pool of route table entries, and of their sources.
+static struct Pool          route_pool;
+static struct Pool          source_pool;
+
+// Kernel MFC writes issued, and skipped because nothing changed.
+static unsigned long        mfc_writes, mfc_suppressed;
+
+// Origin counters are polled every SG_POLL_TICK ms, a slice of the hash
+// index at a time, so that the whole table is done in half 'sourceidle'
+// or in 'statsinterval', whichever is shorter.
+#define SG_POLL_TICK        1000
+static uint32_t             poll_clock;
+static unsigned             poll_cursor;
+static unsigned long        sg_polls, sg_expired;
+
 // Prototypes
 void logRouteTable(const char *header);
 int internAgeRoute(struct RouteTable *croute);
+static int removeRoute(struct RouteTable *croute);
+static struct RouteTable *findRoute(uint32_t group);
 int internUpdateKernelRoute(struct RouteTable *route, int activate);
+static void updateKernelEntry(struct RouteTable *route, struct MfcShadow *shadow,
+                              uint32_t origin, int inVif, int activate);
+static void pollRouteCounters(void *arg);
+
 
+/**
+*   Hash value of the key of a route in the group index.
+*/
+static uint32_t routeHashKey(const void *entry) {
+    return hashMix(((const struct RouteTable *)entry)->group);
+}
 
 /**
-*   Functions for downstream hosts hash table
+*   Functions for the IGMPv3 sources of a route
 */
 
-// MurmurHash3 32bit hash function by Austin Appleby, public domain
-static uint32_t murmurhash3(uint32_t x) {
-    x ^= x >> 16;
-    x *= 0x85ebca6b;
-    x ^= x >> 13;
-    x *= 0xc2b2ae35;
-    x ^= x >> 16;
-    return x;
+static struct RouteSource *findRouteSource(struct RouteTable *croute, uint32_t addr) {
+    struct RouteSource *src;
+
+    for (src = croute->sources; src != NULL; src = src->next) {
+        if (src->addr == addr) {
+            return src;
+        }
+    }
+    return NULL;
 }
 
-static inline void setDownstreamHost(struct Config *conf, struct RouteTable *croute, uint32_t src) {
-    uint32_t hash = murmurhash3(src ^ croute->downstreamHostsHashSeed) % (conf->downstreamHostsHashTableSize*8);
-    BIT_SET(croute->downstreamHostsHashTable[hash/8], hash%8);
+/**
+*   Returns the source 'addr' of the route, and adds it if it is new.
+*/
+static struct RouteSource *addRouteSource(struct RouteTable *croute, uint32_t addr) {
+    struct RouteSource *src = findRouteSource(croute, addr);
+
+    if (src == NULL) {
+        src = (struct RouteSource *)poolAlloc(&source_pool);
+        if (src == NULL) {
+            my_log(LOG_WARNING, 0, "Out of memory. Source %s of %s not added.",
+                inetFmt(addr, s1), inetFmt(croute->group, s2));
+            return NULL;
+        }
+        memset(src, 0, sizeof(*src));
+        src->addr = addr;
+        src->ageValue = getCommonConfig()->robustnessValue;
+        src->next = croute->sources;
+        croute->sources = src;
+    }
+    return src;
 }
 
-static inline void clearDownstreamHost(struct Config *conf, struct RouteTable *croute, uint32_t src) {
-    uint32_t hash = murmurhash3(src ^ croute->downstreamHostsHashSeed) % (conf->downstreamHostsHashTableSize*8);
-    BIT_CLR(croute->downstreamHostsHashTable[hash/8], hash%8);
+/**
+*   Returns the VIFs that have members of any of the sources of the route.
+*/
+static uint32_t routeSourceVifs(struct RouteTable *croute) {
+    struct RouteSource *src;
+    uint32_t vifs = 0;
+
+    for (src = croute->sources; src != NULL; src = src->next) {
+        vifs |= src->vifBits;
+    }
+    return vifs;
 }
 
-static inline void zeroDownstreamHosts(struct Config *conf, struct RouteTable *croute) {
-    croute->downstreamHostsHashSeed = ((uint32_t)rand() << 16) | (uint32_t)rand();
-    memset(croute->downstreamHostsHashTable, 0, conf->downstreamHostsHashTableSize);
+/**
+*   Removes the VIFs 'vifs' from all sources of the route.
+*/
+static void clearSourceVifs(struct RouteTable *croute, uint32_t vifs) {
+    struct RouteSource *src;
+
+    for (src = croute->sources; src != NULL; src = src->next) {
+        src->vifBits &= ~vifs;
+        src->ageVifBits &= ~vifs;
+        src->lmqVifBits &= ~vifs;
+    }
 }
 
-static inline int testNoDownstreamHost(struct Config *conf, struct RouteTable *croute) {
-    for (size_t i = 0; i < conf->downstreamHostsHashTableSize; i++) {
-        if (croute->downstreamHostsHashTable[i])
-            return 0;
+/**
+*   Releases the sources no VIF wants any more, once they are left upstream.
+*/
+static void pruneRouteSources(struct RouteTable *croute) {
+    struct RouteSource **psrc, *src;
+
+    for (psrc = &croute->sources; (src = *psrc) != NULL; ) {
+        if (src->vifBits == 0 && !src->upstrJoined) {
+            *psrc = src->next;
+            poolFree(&source_pool, src);
+        } else {
+            psrc = &src->next;
+        }
     }
-    return 1;
 }
 
 /**
 *   Initializes the routing table.
 */
 void initRouteTable(void) {
+    struct Config *conf = getCommonConfig();
     unsigned Ix;
     struct IfDesc *Dp;
 
+    poolInit(&route_pool, "route", sizeof(struct RouteTable));
+    poolInit(&source_pool, "source", sizeof(struct RouteSource));
+    if (conf->fastUpstreamLeave) {
+        initHosts();
+    }
+
     // Clear routing table...
     routing_table = NULL;
+    hashInit(&route_hash, "route", ROUTE_HASH_MINSIZE, routeHashKey);
+
+    // Start polling the traffic of the origins.
+    if (conf->sourceIdle || conf->statsInterval) {
+        timer_setTimer(SG_POLL_TICK, pollRouteCounters, NULL);
+    }
 
     // Join the all routers group on downstream vifs...
     for ( Ix = 0; (Dp = getIfByIx(Ix)); Ix++ ) {
@@ -139,13 +274,51 @@ void initRouteTable(void) {
     }
 }
 
+/**
+*   Joins or leaves the group of the route, or the source 'source' of it if
+*   that is set, on the upstream IF 'ups'. The change is paced, and counted
+*   against the VIF that last reported on the route.
+*/
+static void upstreamMembership(struct RouteTable *route, int ups, uint32_t source, int join) {
+    paceMembership(ups, route->group, source, join, route->reportVif);
+}
+
+/**
+*   Drops the upstream membership held for a route on one upstream IF.
+*/
+static void leaveUpstream(struct RouteTable *route, int ups) {
+    struct RouteSource  *src;
+
+    if (route->upstrMode == UPSTR_ANY) {
+        upstreamMembership(route, ups, 0, 0);
+    } else if (route->upstrMode == UPSTR_SOURCES) {
+        for (src = route->sources; src != NULL; src = src->next) {
+            if (src->upstrJoined) {
+                upstreamMembership(route, ups, src->addr, 0);
+            }
+        }
+    }
+}
+
 /**
 *   Internal function to send join or leave requests for
-*   a specified route upstream...
+*   a specified route upstream. The whole group is joined if
+*   any downstream VIF wants all sources, and else only the
+*   sources the INCLUDE mode VIFs ask for. A join on a joined
+*   route updates the membership to the current sources.
 */
 static void sendJoinLeaveUpstream(struct RouteTable* route, int join) {
     struct IfDesc*      upstrIf;
-    int i;
+    struct RouteSource  *src;
+    int                 i, mode, done = 0;
+
+    if (!join) {
+        mode = UPSTR_NONE;
+    } else if (route->vifBits & ~route->inclVifBits) {
+        mode = UPSTR_ANY;
+    } else {
+        mode = UPSTR_SOURCES;
+    }
 
     for(i=0; i<MAX_UPS_VIFS; i++)
     {
@@ -157,55 +330,62 @@ static void sendJoinLeaveUpstream(struct RouteTable* route, int join) {
                 my_log(LOG_ERR, 0 ,"FATAL: Unable to get Upstream IF.");
             }
 
-            // Check if there is a black- or whitelist for the upstram VIF
-            if (upstrIf->allowedgroups != NULL) {
-                bool                 allow_list = false;
-                struct SubnetList   *match = NULL;
-                struct SubnetList   *sn;
-                uint32_t             group = route->group;
-
-                // Check if this Request is legit to be forwarded to upstream
-                for(sn = upstrIf->allowedgroups; sn != NULL; sn = sn->next) {
-                    // Check if there is a whitelist
-                    if (sn->allow)
-                        allow_list = true;
-                    if((group & sn->subnet_mask) == sn->subnet_addr)
-                        match = sn;
-                }
-
-                // Keep in sync with request.c, note the negation
-                if(!((!allow_list && match == NULL) ||
-                  (allow_list && match != NULL && match->allow))) {
-                    my_log(LOG_INFO, 0, "The group address %s may not be forwarded upstream. Ignoring.", inetFmt(group, s1));
-                    return;
+            // Check if there is a black- or whitelist for the upstram VIF.
+            // The decision is kept with the route, the lists never change.
+            if (!BIT_TST(route->upstrAclChecked, i)) {
+                if (groupAclAllows(upstrIf->groupAcl, route->group)) {
+                    BIT_SET(route->upstrAclAllowed, i);
                 }
+                BIT_SET(route->upstrAclChecked, i);
+            }
+            if (!BIT_TST(route->upstrAclAllowed, i)) {
+                my_log(LOG_INFO, 0, "The group address %s may not be forwarded upstream. Ignoring.", inetFmt(route->group, s1));
+                break;
             }
 
             // Send join or leave request...
             if(join) {
                 // Only join a group if there are listeners downstream...
                 if(route->vifBits > 0) {
-                    my_log(LOG_DEBUG, 0, "Joining group %s upstream on IF address %s",
-                                 inetFmt(route->group, s1),
-                                 inetFmt(upstrIf->InAdr.s_addr, s2));
-
-                    k_join(upstrIf, route->group);
+                    // Drop a membership of the other kind first.
+                    if (route->upstrMode != mode) {
+                        leaveUpstream(route, i);
+                    }
 
-                    route->upstrState = ROUTESTATE_JOINED;
+                    if (mode == UPSTR_ANY) {
+                        if (route->upstrMode != UPSTR_ANY) {
+                            my_log(LOG_DEBUG, 0, "Joining group %s upstream on IF address %s",
+                                         inetFmt(route->group, s1),
+                                         inetFmt(upstrIf->InAdr.s_addr, s2));
+
+                            upstreamMembership(route, i, 0, 1);
+                        }
+                    } else {
+                        for (src = route->sources; src != NULL; src = src->next) {
+                            int want = (src->vifBits & route->vifBits) != 0;
+                            int joined = route->upstrMode == UPSTR_SOURCES && src->upstrJoined;
+
+                            if (want && !joined) {
+                                upstreamMembership(route, i, src->addr, 1);
+                            } else if (!want && joined) {
+                                upstreamMembership(route, i, src->addr, 0);
+                            }
+                        }
+                    }
+                    done = 1;
                 } else {
                     my_log(LOG_DEBUG, 0, "No downstream listeners for group %s. No join sent.",
                         inetFmt(route->group, s1));
                 }
             } else {
                 // Only leave if group is not left already...
-                if(route->upstrState != ROUTESTATE_NOTJOINED) {
+                if(route->upstrMode != UPSTR_NONE) {
                     my_log(LOG_DEBUG, 0, "Leaving group %s upstream on IF address %s",
                                  inetFmt(route->group, s1),
                                  inetFmt(upstrIf->InAdr.s_addr, s2));
 
-                    k_leave(upstrIf, route->group);
-
-                    route->upstrState = ROUTESTATE_NOTJOINED;
+                    leaveUpstream(route, i);
+                    done = 1;
                 }
             }
         }
@@ -214,6 +394,84 @@ static void sendJoinLeaveUpstream(struct RouteTable* route, int join) {
             i = MAX_UPS_VIFS;
         }
     }
+
+    if (done) {
+        for (src = route->sources; src != NULL; src = src->next) {
+            src->upstrJoined = mode == UPSTR_SOURCES && (src->vifBits & route->vifBits) != 0;
+        }
+        route->upstrMode  = mode;
+        route->upstrState = join ? ROUTESTATE_JOINED : ROUTESTATE_NOTJOINED;
+    }
+    pruneRouteSources(route);
+}
+
+/**
+*   Brings the upstream membership of a route in line with changed
+*   downstream modes or sources, if the group is joined upstream.
+*/
+static void syncUpstream(struct RouteTable *route) {
+    if (route->upstrMode != UPSTR_NONE) {
+        sendJoinLeaveUpstream(route, 1);
+    } else {
+        pruneRouteSources(route);
+    }
+}
+
+/**
+*   Returns 1 if the group of the route is joined on upstream 'ups'. The
+*   joins stop at the first upstream the group may not be joined on.
+*/
+static int joinedUpstream(struct RouteTable *route, int ups) {
+    uint8_t upsBits = (2u << ups) - 1;
+
+    return route->upstrMode != UPSTR_NONE && (route->upstrAclAllowed & upsBits) == upsBits;
+}
+
+/**
+*   Returns the groups joined on upstream 'ups' in a malloc'ed array, and
+*   sets 'count' to their number.
+*/
+uint32_t *getUpstreamGroups(int ups, unsigned *count) {
+    struct RouteTable   *croute;
+    uint32_t            *groups;
+
+    groups = (uint32_t *)malloc((route_hash.count + 1) * sizeof(uint32_t));
+    if (groups == NULL) {
+        my_log(LOG_ERR, 0, "Out of memory.");
+    }
+    *count = 0;
+    for (croute = routing_table; croute != NULL; croute = croute->nextroute) {
+        if (joinedUpstream(croute, ups)) {
+            groups[(*count)++] = croute->group;
+        }
+    }
+    return groups;
+}
+
+/**
+*   Tells the membership of the group on upstream 'ups', for the answer to
+*   a query. Returns IGMPV3_MODE_IS_EXCLUDE if the whole group is joined,
+*   IGMPV3_MODE_IS_INCLUDE if sources of it are, and 0 if it is not joined.
+*   At most 'max' joined sources are copied to 'sources', and 'nsrcs' is
+*   set to their number.
+*/
+int getUpstreamState(uint32_t group, int ups, uint32_t *sources, int max, int *nsrcs) {
+    struct RouteTable   *croute = findRoute(group);
+    struct RouteSource  *src;
+
+    *nsrcs = 0;
+    if (croute == NULL || !joinedUpstream(croute, ups)) {
+        return 0;
+    }
+    if (croute->upstrMode == UPSTR_ANY) {
+        return IGMPV3_MODE_IS_EXCLUDE;
+    }
+    for (src = croute->sources; src != NULL && *nsrcs < max; src = src->next) {
+        if (src->upstrJoined) {
+            sources[(*nsrcs)++] = src->addr;
+        }
+    }
+    return *nsrcs > 0 ? IGMPV3_MODE_IS_INCLUDE : 0;
 }
 
 /**
@@ -240,9 +498,13 @@ void clearAllRoutes(void) {
         sendJoinLeaveUpstream(croute, 0);
 
         // Clear memory, and set pointer to next route...
-        free(croute);
+        clearSourceVifs(croute, ~0u);
+        pruneRouteSources(croute);
+        hostClear(&croute->hosts);
+        poolFree(&route_pool, croute);
     }
     routing_table = NULL;
+    hashClear(&route_hash);
 
     // Send a notice that the routing table is empty...
     my_log(LOG_NOTICE, 0, "All routes removed. Routing table is empty.");
@@ -254,8 +516,10 @@ void clearAllRoutes(void) {
 */
 static struct RouteTable *findRoute(uint32_t group) {
     struct RouteTable*  croute;
+    unsigned            slot;
 
-    for(croute = routing_table; croute; croute = croute->nextroute) {
+    for(slot = hashSlot(&route_hash, hashMix(group)); (croute = route_hash.slots[slot]);
+        slot = hashNext(&route_hash, slot)) {
         if(croute->group == group) {
             return croute;
         }
@@ -264,6 +528,66 @@ static struct RouteTable *findRoute(uint32_t group) {
     return NULL;
 }
 
+/**
+*   Creates a route for the group without listeners, and links it
+*   into the table.
+*/
+static struct RouteTable *createRoute(uint32_t group) {
+    struct Config *conf = getCommonConfig();
+    struct RouteTable*  newroute;
+
+    my_log(LOG_DEBUG, 0, "No existing route for %s. Create new.",
+                 inetFmt(group, s1));
+
+
+    // Create and initialize the new route table entry..
+    newroute = (struct RouteTable*)poolAlloc(&route_pool);
+    if(newroute == NULL) {
+        my_log(LOG_WARNING, 0, "Out of memory. Table insert failed.");
+        return NULL;
+    }
+    // Insert the route desc and clear all pointers...
+    newroute->group      = group;
+    memset(newroute->originAddrs, 0, MAX_ORIGINS * sizeof(newroute->originAddrs[0]));
+    for (int i = 0; i < MAX_ORIGINS; i++) {
+        newroute->mfc[i].inVif = -1;
+    }
+    newroute->anyMfc.inVif = -1;
+    newroute->nextroute  = NULL;
+    newroute->prevroute  = NULL;
+    newroute->upstrVif   = -1;
+    newroute->reportVif  = -1;
+    newroute->upstrAclChecked = 0;
+    newroute->upstrAclAllowed = 0;
+    newroute->sources    = NULL;
+    hostSetInit(&newroute->hosts);
+
+    // The group is not joined initially.
+    newroute->upstrState = ROUTESTATE_NOTJOINED;
+    newroute->upstrMode  = UPSTR_NONE;
+
+    // The route is not active yet, so the age is unimportant.
+    newroute->ageValue    = conf->robustnessValue;
+    newroute->ageActivity = 0;
+
+    BIT_ZERO(newroute->ageVifBits);     // Initially we assume no listeners.
+
+    // Set the listener flag...
+    BIT_ZERO(newroute->vifBits);    // Initially no listeners...
+    BIT_ZERO(newroute->lmqVifBits);
+    BIT_ZERO(newroute->inclVifBits);
+
+    // Link the route at the head of the list, and index it by group.
+    newroute->nextroute = routing_table;
+    if(routing_table != NULL) {
+        routing_table->prevroute = newroute;
+    }
+    routing_table = newroute;
+    hashInsert(&route_hash, newroute);
+
+    return newroute;
+}
+
 /**
 *   Adds a specified route to the routingtable.
 *   If the route already exists, the existing route
@@ -290,107 +614,46 @@ int insertRoute(uint32_t group, int ifx, uint32_t src) {
     // Try to find an existing route for this group...
     croute = findRoute(group);
     if(croute==NULL) {
-        struct RouteTable*  newroute;
-
-        my_log(LOG_DEBUG, 0, "No existing route for %s. Create new.",
-                     inetFmt(group, s1));
-
-
-        // Create and initialize the new route table entry..
-        newroute = (struct RouteTable*)malloc(sizeof(struct RouteTable) + (conf->fastUpstreamLeave ? conf->downstreamHostsHashTableSize : 0));
-        // Insert the route desc and clear all pointers...
-        newroute->group      = group;
-        memset(newroute->originAddrs, 0, MAX_ORIGINS * sizeof(newroute->originAddrs[0]));
-        newroute->nextroute  = NULL;
-        newroute->prevroute  = NULL;
-        newroute->upstrVif   = -1;
+        croute = createRoute(group);
+        if(croute == NULL) {
+            return 0;
+        }
 
+        // Add downstream host
         if(conf->fastUpstreamLeave) {
-            // Init downstream hosts bit hash table
-            zeroDownstreamHosts(conf, newroute);
-
-            // Add downstream host
-            setDownstreamHost(conf, newroute, src);
+            hostAdd(&croute->hosts, group, ifx, src);
         }
 
-        // The group is not joined initially.
-        newroute->upstrState = ROUTESTATE_NOTJOINED;
-
-        // The route is not active yet, so the age is unimportant.
-        newroute->ageValue    = conf->robustnessValue;
-        newroute->ageActivity = 0;
-
-        BIT_ZERO(newroute->ageVifBits);     // Initially we assume no listeners.
-
         // Set the listener flag...
-        BIT_ZERO(newroute->vifBits);    // Initially no listeners...
         if(ifx >= 0) {
-            BIT_SET(newroute->vifBits, ifx);
-        }
-
-        // Check if there is a table already....
-        if(routing_table == NULL) {
-            // No location set, so insert in on the table top.
-            routing_table = newroute;
-            my_log(LOG_DEBUG, 0, "No routes in table. Insert at beginning.");
-        } else {
-
-            my_log(LOG_DEBUG, 0, "Found existing routes. Find insert location.");
-
-            // Check if the route could be inserted at the beginning...
-            if(routing_table->group > group) {
-                my_log(LOG_DEBUG, 0, "Inserting at beginning, before route %s",inetFmt(routing_table->group,s1));
-
-                // Insert at beginning...
-                newroute->nextroute = routing_table;
-                newroute->prevroute = NULL;
-                routing_table = newroute;
-
-                // If the route has a next node, the previous pointer must be updated.
-                if(newroute->nextroute != NULL) {
-                    newroute->nextroute->prevroute = newroute;
-                }
-
-            } else {
-
-                // Find the location which is closest to the route.
-                for( croute = routing_table; croute->nextroute != NULL; croute = croute->nextroute ) {
-                    // Find insert position.
-                    if(croute->nextroute->group > group) {
-                        break;
-                    }
-                }
-
-                my_log(LOG_DEBUG, 0, "Inserting after route %s",inetFmt(croute->group,s1));
-
-                // Insert after current...
-                newroute->nextroute = croute->nextroute;
-                newroute->prevroute = croute;
-                if(croute->nextroute != NULL) {
-                    croute->nextroute->prevroute = newroute;
-                }
-                croute->nextroute = newroute;
-            }
+            BIT_SET(croute->vifBits, ifx);
         }
 
-        // Set the new route as the current...
-        croute = newroute;
-
         // Log the cleanup in debugmode...
         my_log(LOG_INFO, 0, "Inserted route table entry for %s on VIF #%d",
             inetFmt(croute->group, s1),ifx);
 
+        // With (*,G) entries the data can flow before the first upcall.
+        if(ifx >= 0 && conf->proxyMfc) {
+            internUpdateKernelRoute(croute, 1);
+        }
+
     } else if(ifx >= 0) {
 
         // The route exists already, so just update it.
         BIT_SET(croute->vifBits, ifx);
 
+        // A member answered the last member check of the VIF, and
+        // the members on the VIF want all sources.
+        BIT_CLR(croute->lmqVifBits, ifx);
+        BIT_CLR(croute->inclVifBits, ifx);
+
         // Register the VIF activity for the aging routine
         BIT_SET(croute->ageVifBits, ifx);
 
         // Register dwnstrHosts for host tracking if fastleave is enabled
         if(conf->fastUpstreamLeave) {
-            setDownstreamHost(conf, croute, src);
+            hostAdd(&croute->hosts, group, ifx, src);
         }
 
         // Log the cleanup in debugmode...
@@ -404,8 +667,10 @@ int insertRoute(uint32_t group, int ifx, uint32_t src) {
         }
     }
 
-    // Send join message upstream, if the route has no joined flag...
-    if(croute->upstrState != ROUTESTATE_JOINED) {
+    // Send join message upstream, if the route has no joined flag,
+    // or only the sources of the group are joined...
+    croute->reportVif = ifx;
+    if(croute->upstrState != ROUTESTATE_JOINED || croute->upstrMode == UPSTR_SOURCES) {
         // Send Join request upstream
         sendJoinLeaveUpstream(croute, 1);
     }
@@ -457,24 +722,44 @@ int activateRoute(uint32_t group, uint32_t originAddr, int upstrVif) {
                     inetFmt(croute->group, s1),
                     inetFmt(croute->originAddrs[i], s2),
                     inetFmt(originAddr, s3));
+
+                // The kernel entry of the replaced origin must not outlive it.
+                if (croute->mfc[i].inVif != -1) {
+                    updateKernelEntry(croute, &croute->mfc[i], croute->originAddrs[i],
+                        croute->mfc[i].inVif, 0);
+                }
             }
 
             // set origin
-            croute->originAddrs[i] = originAddr;
+            if (croute->originAddrs[i] != originAddr) {
+                croute->originAddrs[i] = originAddr;
+                croute->mfc[i].inVif = -1;
+                memset(&croute->count[i], 0, sizeof(croute->count[i]));
+                croute->count[i].polled = croute->count[i].active = poll_clock;
+            }
 
             // move it to the top
             while (i > 0) {
                 uint32_t t = croute->originAddrs[i - 1];
+                struct MfcShadow m = croute->mfc[i - 1];
+                struct OriginCount c = croute->count[i - 1];
                 croute->originAddrs[i - 1] = croute->originAddrs[i];
                 croute->originAddrs[i] = t;
+                croute->mfc[i - 1] = croute->mfc[i];
+                croute->mfc[i] = m;
+                croute->count[i - 1] = croute->count[i];
+                croute->count[i] = c;
                 i--;
             }
         }
         croute->upstrVif = upstrVif;
 
-        // Only update kernel table if there are listeners !
+        // Only update kernel table if there are listeners ! Otherwise the
+        // flow is dropped until someone joins, or the drop entry expires.
         if(croute->vifBits > 0) {
             result = internUpdateKernelRoute(croute, 1);
+        } else if(originAddr > 0) {
+            dropCacheAdd(originAddr, group, upstrVif);
         }
     }
     logRouteTable("Activate Route");
@@ -483,6 +768,124 @@ int activateRoute(uint32_t group, uint32_t originAddr, int upstrVif) {
 }
 
 
+/**
+*   Returns the upstream VIF traffic from 'addr' is expected on, or -1.
+*/
+static int sourceUpstreamVif(uint32_t addr) {
+    struct IfDesc *Dp;
+    uint64_t ifBits = 0;
+    int i;
+
+    lookupIfByAddress(addr, &ifBits);
+    for (i = 0; i < MAX_UPS_VIFS && upStreamIfIdx[i] != -1; i++) {
+        if ((ifBits & (uint64_t)1 << upStreamIfIdx[i]) != 0) {
+            break;
+        }
+    }
+    if (i == MAX_UPS_VIFS || upStreamIfIdx[i] == -1) {
+        i = 0;
+    }
+    Dp = upStreamIfIdx[i] != -1 ? getIfByIx(upStreamIfIdx[i]) : NULL;
+    return Dp != NULL ? (int)Dp->index : -1;
+}
+
+/**
+*   Updates the sources of the group wanted on VIF 'ifx' from an IGMPv3
+*   source record of 'type' sent by 'src'. The sources of an ALLOW or an
+*   INCLUDE record are added, while those of a BLOCK record are checked
+*   for other members. Returns 1 if the VIF should be queried.
+*/
+int updateRouteSources(uint32_t group, int ifx, uint32_t src, int type,
+                       int nsrcs, const struct in_addr *sources) {
+    struct Config       *conf = getCommonConfig();
+    struct RouteTable   *croute;
+    struct RouteSource  *rsrc;
+    int                 i, upstrVif, query = 0;
+
+    if(ifx < 0 || ifx >= MAXVIFS || nsrcs <= 0) {
+        return 0;
+    }
+    croute = findRoute(group);
+
+    if(type == IGMPV3_BLOCK_OLD_SOURCES) {
+        // Only VIFs that want single sources can stop getting some.
+        if(croute == NULL || !BIT_TST(croute->inclVifBits, ifx)) {
+            return 0;
+        }
+        for (i = 0; i < nsrcs; i++) {
+            rsrc = findRouteSource(croute, sources[i].s_addr);
+            if (rsrc != NULL && BIT_TST(rsrc->vifBits, ifx)) {
+                BIT_SET(rsrc->lmqVifBits, ifx);
+                query = 1;
+            }
+        }
+        return query;
+    }
+
+    if(croute == NULL && (croute = createRoute(group)) == NULL) {
+        return 0;
+    }
+    croute->reportVif = ifx;
+
+    // A VIF new to the route only wants the listed sources.
+    if(!BIT_TST(croute->vifBits, ifx)) {
+        BIT_SET(croute->vifBits, ifx);
+        BIT_SET(croute->inclVifBits, ifx);
+    }
+    BIT_SET(croute->ageVifBits, ifx);
+    if(BIT_TST(croute->inclVifBits, ifx)) {
+        BIT_CLR(croute->lmqVifBits, ifx);
+    }
+    if(conf->fastUpstreamLeave) {
+        hostAdd(&croute->hosts, group, ifx, src);
+    }
+
+    for (i = 0; i < nsrcs; i++) {
+        uint32_t addr = sources[i].s_addr;
+        int added;
+
+        if (addr == 0 || IN_MULTICAST(ntohl(addr))) {
+            continue;
+        }
+        if ((rsrc = addRouteSource(croute, addr)) == NULL) {
+            break;
+        }
+        added = !BIT_TST(rsrc->vifBits, ifx);
+        BIT_SET(rsrc->vifBits, ifx);
+        BIT_SET(rsrc->ageVifBits, ifx);
+        BIT_CLR(rsrc->lmqVifBits, ifx);
+
+        // The entry of a new source is installed right away, so that its
+        // traffic flows without waiting for an upcall. The kernel sends
+        // none at all for sources a (*,G) entry forwards. Sources beyond
+        // the origins of the route wait for their upcall, rather than
+        // replace the entries of other sources.
+        if (added && croute->originAddrs[MAX_ORIGINS - 1] == 0 &&
+            (upstrVif = sourceUpstreamVif(addr)) != -1) {
+            activateRoute(group, addr, upstrVif);
+        }
+    }
+
+    // Members changing to INCLUDE mode may leave others wanting all sources.
+    if(type == IGMPV3_CHANGE_TO_INCLUDE && !BIT_TST(croute->inclVifBits, ifx)) {
+        BIT_SET(croute->lmqVifBits, ifx);
+        query = 1;
+    }
+
+    my_log(LOG_INFO, 0, "Updated sources of %s on VIF #%d",
+        inetFmt(croute->group, s1), ifx);
+
+    if(!internUpdateKernelRoute(croute, 1)) {
+        my_log(LOG_WARNING, 0, "The insertion into Kernel failed.");
+    }
+    sendJoinLeaveUpstream(croute, 1);
+
+    logRouteTable("Update sources");
+
+    return query;
+}
+
+
 /**
 *   This function loops through all routes, and updates the age
 *   of any active routes.
@@ -508,93 +911,145 @@ void ageActiveRoutes(void) {
 }
 
 /**
-*   Counts the number of interfaces a given route is active on
-*/
-int numberOfInterfaces(struct RouteTable *croute) {
-    int Ix;
-    struct IfDesc *Dp;
-    int result = 0;
-    // Loop through all interfaces
-    for ( Ix = 0; (Dp = getIfByIx(Ix)); Ix++ ) {
-        // If the interface is used by the route, increase counter
-        if(BIT_TST(croute->vifBits, Dp->index)) {
-            result++;
-        }
-    }
-    my_log(LOG_DEBUG, 0, "counted %d interfaces", result);
-    return result;
-}
-
-/**
-*   Should be called when a leave message is received, to
-*   mark a route for the last member probe state.
+*   Should be called when a leave message is received on VIF 'ifx', to
+*   start the last member probe of the group on that VIF. Returns 1 if
+*   the VIF should be queried, and 0 if there is no need to.
 */
-void setRouteLastMemberMode(uint32_t group, uint32_t src) {
+int setRouteLastMemberMode(uint32_t group, int ifx, uint32_t src) {
     struct Config       *conf = getCommonConfig();
     struct RouteTable   *croute;
-    int                 routeStateCheck = 1;
 
     croute = findRoute(group);
-    if(!croute)
-        return;
+    if(!croute || ifx < 0 || ifx >= MAXVIFS || !BIT_TST(croute->vifBits, ifx))
+        return 0;
+    croute->reportVif = ifx;
 
     // Check for fast leave mode...
     if(conf->fastUpstreamLeave) {
         if(croute->upstrState == ROUTESTATE_JOINED) {
             // Remove downstream host from route
-            clearDownstreamHost(conf, croute, src);
-        }
-
-        // Do route state check if there is no downstream host in hash table
-        // This host does not have to been the last downstream host if hash collision occurred
-        routeStateCheck = testNoDownstreamHost(conf, croute);
+            hostDel(&croute->hosts, group, ifx, src);
 
-        if(croute->upstrState == ROUTESTATE_JOINED) {
             // Send a leave message right away but only when the route is not active anymore on any downstream host
-            // It is possible that there are still some interfaces active but no downstream host in hash table due to hash collision
-            if (routeStateCheck && numberOfInterfaces(croute) <= 1) {
+            if (croute->hosts.count == 0) {
                 my_log(LOG_DEBUG, 0, "quickleave is enabled and this was the last downstream host, leaving group %s now", inetFmt(croute->group, s1));
                 sendJoinLeaveUpstream(croute, 0);
             } else {
                 my_log(LOG_DEBUG, 0, "quickleave is enabled but there are still some downstream hosts left, not leaving group %s", inetFmt(croute->group, s1));
             }
         }
+
+        // Other hosts on the VIF are still members.
+        if(croute->hosts.vifCount[ifx] > 0) {
+            return 0;
+        }
     }
 
-    // Set the routingstate to last member check if we have no known downstream host left or if fast leave mode is disabled...
-    if(routeStateCheck) {
-        croute->upstrState = ROUTESTATE_CHECK_LAST_MEMBER;
+    // Members of single sources are asked for as well.
+    if(BIT_TST(croute->inclVifBits, ifx)) {
+        struct RouteSource *rsrc;
+
+        for (rsrc = croute->sources; rsrc != NULL; rsrc = rsrc->next) {
+            if (BIT_TST(rsrc->vifBits, ifx)) {
+                BIT_SET(rsrc->lmqVifBits, ifx);
+            }
+        }
+    }
+    BIT_SET(croute->lmqVifBits, ifx);
 
-        // Set the count value for expiring... (-1 since first aging)
-        croute->ageValue = conf->lastMemberQueryCount;
+    // The group is in the last member check when all of its VIFs are.
+    if((croute->vifBits & ~croute->lmqVifBits) == 0) {
+        croute->upstrState = ROUTESTATE_CHECK_LAST_MEMBER;
     }
+    return 1;
 }
 
 
 /**
-*   Ages groups in the last member check state. If the
-*   route is not found, or not in this state, 0 is returned.
+*   Returns 1 while the last member check of the group, or of some of its
+*   sources, on VIF 'ifx' goes on, and 0 once the members have answered or
+*   the route is gone.
 */
-int lastMemberGroupAge(uint32_t group) {
+int lastMemberVifCheck(uint32_t group, int ifx) {
     struct RouteTable   *croute;
+    struct RouteSource  *rsrc;
 
     croute = findRoute(group);
-    if(croute!=NULL) {
-        if(croute->upstrState == ROUTESTATE_CHECK_LAST_MEMBER) {
-            return !internAgeRoute(croute);
-        } else {
-            return 0;
+    if(croute == NULL || ifx < 0 || ifx >= MAXVIFS)
+        return 0;
+    if(BIT_TST(croute->lmqVifBits, ifx))
+        return 1;
+    for (rsrc = croute->sources; rsrc != NULL; rsrc = rsrc->next) {
+        if (BIT_TST(rsrc->lmqVifBits, ifx)) {
+            return 1;
         }
     }
     return 0;
 }
 
+/**
+*   Ends the last member check of the group on VIF 'ifx' when no member
+*   has answered. The sources nobody asked for again are removed from the
+*   VIF, and a VIF whose members only want single sources left keeps those.
+*   The route itself is removed when its last VIF goes.
+*/
+void lastMemberVifExpire(uint32_t group, int ifx) {
+    struct RouteTable   *croute;
+    struct RouteSource  *rsrc;
+
+    if(!lastMemberVifCheck(group, ifx))
+        return;
+    croute = findRoute(group);
+    croute->reportVif = ifx;
+
+    for (rsrc = croute->sources; rsrc != NULL; rsrc = rsrc->next) {
+        if (BIT_TST(rsrc->lmqVifBits, ifx)) {
+            BIT_CLR(rsrc->vifBits, ifx);
+            BIT_CLR(rsrc->ageVifBits, ifx);
+            BIT_CLR(rsrc->lmqVifBits, ifx);
+        }
+    }
+
+    // Nobody wants all sources any more, but sources may still be wanted.
+    if(BIT_TST(croute->lmqVifBits, ifx)) {
+        BIT_CLR(croute->lmqVifBits, ifx);
+        BIT_SET(croute->inclVifBits, ifx);
+    }
+
+    // A VIF only wanting single sources, but none of them, has no members.
+    if(!BIT_TST(routeSourceVifs(croute), ifx)) {
+        BIT_CLR(croute->vifBits, ifx);
+        BIT_CLR(croute->ageVifBits, ifx);
+        BIT_CLR(croute->inclVifBits, ifx);
+        hostClearVif(&croute->hosts, ifx);
+    }
+
+    if(croute->vifBits == 0) {
+        my_log(LOG_DEBUG, 0, "No members of %s left. Removing route.",
+            inetFmt(croute->group, s1));
+        removeRoute(croute);
+    } else {
+        my_log(LOG_DEBUG, 0, "No more members of %s or some of its sources on VIF %d.",
+            inetFmt(croute->group, s1), ifx);
+        internUpdateKernelRoute(croute, 1);
+
+        // The group may have been left with quickleave, while members of
+        // single sources are left.
+        if(croute->upstrState == ROUTESTATE_CHECK_LAST_MEMBER &&
+           (croute->vifBits & ~croute->lmqVifBits) != 0) {
+            sendJoinLeaveUpstream(croute, 1);
+        } else {
+            syncUpstream(croute);
+        }
+        logRouteTable("Last member expired");
+    }
+}
+
 /**
 *   Remove a specified route. Returns 1 on success,
 *   and 0 if route was not found.
 */
 static int removeRoute(struct RouteTable*  croute) {
-    struct Config       *conf = getCommonConfig();
     int result = 1;
 
     // If croute is null, no routes was found.
@@ -614,14 +1069,20 @@ static int removeRoute(struct RouteTable*  croute) {
         result = 0;
     }
 
+    // Forget the downstream hosts.
+    hostClear(&croute->hosts);
+
     // Send Leave request upstream if group is joined
-    if(croute->upstrState == ROUTESTATE_JOINED || 
-       (croute->upstrState == ROUTESTATE_CHECK_LAST_MEMBER && !conf->fastUpstreamLeave)) 
-    {
+    if(croute->upstrMode != UPSTR_NONE) {
         sendJoinLeaveUpstream(croute, 0);
     }
 
+    // Forget the sources.
+    clearSourceVifs(croute, ~0u);
+    pruneRouteSources(croute);
+
     // Update pointers...
+    hashRemove(&route_hash, croute);
     if(croute->prevroute == NULL) {
         // Topmost node...
         if(croute->nextroute != NULL) {
@@ -636,7 +1097,7 @@ static int removeRoute(struct RouteTable*  croute) {
         }
     }
     // Free the memory, and set the route to NULL...
-    free(croute);
+    poolFree(&route_pool, croute);
     croute = NULL;
 
     logRouteTable("Remove route");
@@ -645,6 +1106,28 @@ static int removeRoute(struct RouteTable*  croute) {
 }
 
 
+/**
+*   Ages the sources of a route. A VIF that has not reported a source for
+*   'robustness' rounds stops receiving it. Returns 1 if a source lost a VIF.
+*/
+static int ageRouteSources(struct RouteTable *croute) {
+    struct Config *conf = getCommonConfig();
+    struct RouteSource *rsrc;
+    int changed = 0;
+
+    for (rsrc = croute->sources; rsrc != NULL; rsrc = rsrc->next) {
+        if ((rsrc->vifBits & ~rsrc->ageVifBits) == 0) {
+            rsrc->ageValue = conf->robustnessValue;
+        } else if (--rsrc->ageValue <= 0) {
+            rsrc->vifBits &= rsrc->ageVifBits;
+            rsrc->ageValue = conf->robustnessValue;
+            changed = 1;
+        }
+        BIT_ZERO(rsrc->ageVifBits);
+    }
+    return changed;
+}
+
 /**
 *   Ages a specific route
 */
@@ -652,6 +1135,12 @@ int internAgeRoute(struct RouteTable*  croute) {
     struct Config *conf = getCommonConfig();
     int result = 0;
 
+    // Age the sources wanted by INCLUDE mode members.
+    if(croute->sources != NULL && ageRouteSources(croute)) {
+        internUpdateKernelRoute(croute, 1);
+        syncUpstream(croute);
+    }
+
     // Drop age by 1.
     croute->ageValue--;
 
@@ -666,8 +1155,18 @@ int internAgeRoute(struct RouteTable*  croute) {
             // One or more VIF has not gotten any response.
             croute->ageActivity++;
 
+            // The hosts on those VIFs are gone.
+            for (int i = 0; i < MAXVIFS && croute->hosts.count > 0; i++) {
+                if (BIT_TST(croute->vifBits, i) && !BIT_TST(croute->ageVifBits, i)) {
+                    hostClearVif(&croute->hosts, i);
+                }
+            }
+
             // Update the actual bits for the route...
+            clearSourceVifs(croute, croute->vifBits & ~croute->ageVifBits);
+            croute->inclVifBits &= croute->ageVifBits;
             croute->vifBits = croute->ageVifBits;
+            syncUpstream(croute);
         }
     }
     // Check if there have been activity in aging process...
@@ -716,54 +1215,289 @@ int internAgeRoute(struct RouteTable*  croute) {
 }
 
 /**
-*   Updates the Kernel routing table. If activate is 1, the route
-*   is (re-)activated. If activate is false, the route is removed.
+*   Writes the kernel entry from 'origin' for the route, unless 'shadow'
+*   shows the kernel has it already. If activate is false, the entry is
+*   removed. An origin of 0 is the (*,G) entry of the route, which also
+*   forwards from its input VIF to the downstream VIFs.
 */
-int internUpdateKernelRoute(struct RouteTable *route, int activate) {
+static void updateKernelEntry(struct RouteTable *route, struct MfcShadow *shadow,
+                              uint32_t origin, int inVif, int activate) {
     struct   MRouteDesc mrDesc;
     struct   IfDesc     *Dp;
+    struct   RouteSource *src;
+    uint32_t            srcVifBits = 0;
     unsigned            Ix;
+
+    // Build route descriptor from table entry...
+    // Set the source address and group address...
+    mrDesc.McAdr.s_addr     = route->group;
+    mrDesc.OriginAdr.s_addr = origin;
+
+    // clear output interfaces
+    memset( mrDesc.TtlVc, 0, sizeof( mrDesc.TtlVc ) );
+
+    my_log(LOG_DEBUG, 0, "Vif bits : 0x%08x", route->vifBits);
+
+    mrDesc.InVif = inVif;
+
+    // The routing table takes over a drop entry of the flow.
+    if (origin != 0) {
+        dropCacheForget(origin, route->group);
+    }
+
+    // INCLUDE mode VIFs only get the sources they asked for.
+    if (origin != 0 && (src = findRouteSource(route, origin)) != NULL) {
+        srcVifBits = src->vifBits;
+    }
+
+    // Set the TTL's for the route descriptor...
+    for ( Ix = 0; (Dp = getIfByIx(Ix)); Ix++ ) {
+        if(Dp->state == IF_STATE_UPSTREAM) {
+            // The kernel only matches a (*,G) entry on VIFs in its TTL vector.
+            if (origin == 0 && (int)Dp->index == inVif) {
+                mrDesc.TtlVc[ Dp->index ] = Dp->threshold;
+            }
+            continue;
+        }
+        else if(BIT_TST(route->vifBits, Dp->index) &&
+                (!BIT_TST(route->inclVifBits, Dp->index) || BIT_TST(srcVifBits, Dp->index))) {
+            my_log(LOG_DEBUG, 0, "Setting TTL for Vif %d to %d", Dp->index, Dp->threshold);
+            mrDesc.TtlVc[ Dp->index ] = Dp->threshold;
+        }
+    }
+
+    // Do the actual Kernel route update...
+    if(activate) {
+        // Skip the write if the kernel has the entry already.
+        if (shadow->inVif == mrDesc.InVif &&
+            memcmp(shadow->ttls, mrDesc.TtlVc, sizeof(mrDesc.TtlVc)) == 0) {
+            mfc_suppressed++;
+            return;
+        }
+
+        // Add route in kernel...
+        mfc_writes++;
+        if (addMRoute( &mrDesc ) == 0) {
+            shadow->inVif = mrDesc.InVif;
+            memcpy(shadow->ttls, mrDesc.TtlVc, sizeof(mrDesc.TtlVc));
+        } else {
+            shadow->inVif = -1;
+        }
+    } else {
+        // Delete the route from Kernel...
+        mfc_writes++;
+        delMRoute( &mrDesc );
+        shadow->inVif = -1;
+    }
+}
+
+/**
+*   Updates the Kernel routing table. If activate is 1, the route
+*   is (re-)activated. If activate is false, the route is removed.
+*/
+int internUpdateKernelRoute(struct RouteTable *route, int activate) {
+    struct Config *conf = getCommonConfig();
     int i;
 
     for (i = 0; i < MAX_ORIGINS; i++) {
         if (route->originAddrs[i] == 0 || route->upstrVif == -1) {
             continue;
         }
+        updateKernelEntry(route, &route->mfc[i], route->originAddrs[i], route->upstrVif, activate);
+    }
+
+    // The (*,G) entry takes traffic from the first upstream VIF while
+    // there are listeners for all sources.
+    if (conf->proxyMfc) {
+        struct IfDesc *upstrIf = upStreamIfIdx[0] >= 0 ? getIfByIx(upStreamIfIdx[0]) : NULL;
+
+        if (activate && (route->vifBits & ~route->inclVifBits) && upstrIf != NULL) {
+            updateKernelEntry(route, &route->anyMfc, 0, upstrIf->index, 1);
+        } else if (route->anyMfc.inVif != -1) {
+            updateKernelEntry(route, &route->anyMfc, 0, route->anyMfc.inVif, 0);
+        }
+    }
+
+    return 1;
+}
 
-        // Build route descriptor from table entry...
-        // Set the source address and group address...
-        mrDesc.McAdr.s_addr     = route->group;
-        mrDesc.OriginAdr.s_addr = route->originAddrs[i];
+/**
+*   Forgets what was installed in the kernel, so that the next update
+*   of each route is written. Used when the VIFs have changed.
+*/
+void invalidateKernelRoutes(void) {
+    struct RouteTable   *croute;
+    int i;
 
-        // clear output interfaces
-        memset( mrDesc.TtlVc, 0, sizeof( mrDesc.TtlVc ) );
+    for (croute = routing_table; croute != NULL; croute = croute->nextroute) {
+        for (i = 0; i < MAX_ORIGINS; i++) {
+            croute->mfc[i].inVif = -1;
+        }
+        croute->anyMfc.inVif = -1;
+    }
+}
 
-        my_log(LOG_DEBUG, 0, "Vif bits : 0x%08x", route->vifBits);
+/**
+*   Removes origin 'i' from the route, and moves the following origins up
+*   to keep the unused slots at the bottom.
+*/
+static void removeOrigin(struct RouteTable *croute, int i) {
+    for (; i < MAX_ORIGINS - 1; i++) {
+        croute->originAddrs[i] = croute->originAddrs[i + 1];
+        croute->mfc[i] = croute->mfc[i + 1];
+        croute->count[i] = croute->count[i + 1];
+    }
+    croute->originAddrs[i] = 0;
+    croute->mfc[i].inVif = -1;
+}
 
-        mrDesc.InVif = route->upstrVif;
+/**
+*   Reads the kernel counters of the origins of a route, and removes the
+*   origins that sent nothing for 'sourceidle' seconds.
+*/
+static void pollRoute(struct Config *conf, struct RouteTable *croute) {
+    struct MRouteDesc   mrDesc;
+    struct OriginCount  *cnt;
+    unsigned long       pkts, bytes;
+    uint32_t            elapsed;
+    int                 i = 0;
+
+    while (i < MAX_ORIGINS && croute->originAddrs[i] != 0) {
+        cnt = &croute->count[i];
+
+        // Only installed entries have counters.
+        if (croute->mfc[i].inVif == -1) {
+            i++;
+            continue;
+        }
 
-        // Set the TTL's for the route descriptor...
-        for ( Ix = 0; (Dp = getIfByIx(Ix)); Ix++ ) {
-            if(Dp->state == IF_STATE_UPSTREAM) {
-                continue;
+        mrDesc.OriginAdr.s_addr = croute->originAddrs[i];
+        mrDesc.McAdr.s_addr     = croute->group;
+        sg_polls++;
+        if (getMRouteCount(&mrDesc, &pkts, &bytes) == 0) {
+            elapsed = poll_clock - cnt->polled;
+            if (pkts != cnt->pktCnt) {
+                cnt->active = poll_clock;
             }
-            else if(BIT_TST(route->vifBits, Dp->index)) {
-                my_log(LOG_DEBUG, 0, "Setting TTL for Vif %d to %d", Dp->index, Dp->threshold);
-                mrDesc.TtlVc[ Dp->index ] = Dp->threshold;
+            if (elapsed > 0 && pkts >= cnt->pktCnt && bytes >= cnt->byteCnt) {
+                cnt->pktRate  = (pkts - cnt->pktCnt) * 1000 / elapsed;
+                cnt->byteRate = (bytes - cnt->byteCnt) * 1000 / elapsed;
             }
+            cnt->pktCnt  = pkts;
+            cnt->byteCnt = bytes;
+            cnt->polled  = poll_clock;
         }
 
-        // Do the actual Kernel route update...
-        if(activate) {
-            // Add route in kernel...
-            addMRoute( &mrDesc );
-        } else {
-            // Delete the route from Kernel...
-            delMRoute( &mrDesc );
+        if (conf->sourceIdle && poll_clock - cnt->active >= conf->sourceIdle * 1000) {
+            my_log(LOG_DEBUG, 0, "Removing idle origin %s of group %s.",
+                inetFmt(croute->originAddrs[i], s1), inetFmt(croute->group, s2));
+            updateKernelEntry(croute, &croute->mfc[i], croute->originAddrs[i],
+                              croute->mfc[i].inVif, 0);
+            removeOrigin(croute, i);
+            sg_expired++;
+            continue;
         }
+        i++;
+    }
+}
+
+/**
+*   Timer callback, polls the next slice of the routing table.
+*/
+static void pollRouteCounters(void *arg) {
+    struct Config   *conf = getCommonConfig();
+    unsigned        sweep = conf->sourceIdle ? conf->sourceIdle * 1000 / 2 : UINT_MAX;
+    unsigned        ticks, n;
+
+    poll_clock += SG_POLL_TICK;
+    if (conf->statsInterval && conf->statsInterval * 1000 < sweep) {
+        sweep = conf->statsInterval * 1000;
+    }
+    ticks = sweep / SG_POLL_TICK;
+    if (ticks == 0) {
+        ticks = 1;
     }
 
-    return 1;
+    for (n = (route_hash.size + ticks - 1) / ticks; n > 0; n--, poll_cursor++) {
+        if (poll_cursor >= route_hash.size) {
+            poll_cursor = 0;
+        }
+        if (route_hash.slots[poll_cursor] != NULL) {
+            pollRoute(conf, (struct RouteTable *)route_hash.slots[poll_cursor]);
+        }
+    }
+
+    timer_setTimer(SG_POLL_TICK, pollRouteCounters, arg);
+}
+
+/**
+*   Writes the routing table statistics to 'fp', or to the log if 'fp'
+*   is NULL.
+*/
+void routeDumpStats(FILE *fp) {
+    struct Config *conf = getCommonConfig();
+
+    statsLine(fp, "route.count %u", route_hash.count);
+    statsLine(fp, "route.mfc.writes %lu", mfc_writes);
+    statsLine(fp, "route.mfc.suppressed %lu", mfc_suppressed);
+    statsLine(fp, "route.origins.polls %lu", sg_polls);
+    statsLine(fp, "route.origins.expired %lu", sg_expired);
+
+    // The traffic of each origin only goes to the stats file, the log
+    // would be flooded with it.
+    if (fp != NULL && conf->statsInterval) {
+        struct RouteTable *croute;
+        char name[40];
+        int i;
+
+        for (croute = routing_table; croute != NULL; croute = croute->nextroute) {
+            for (i = 0; i < MAX_ORIGINS && croute->originAddrs[i] != 0; i++) {
+                if (croute->mfc[i].inVif == -1) {
+                    continue;
+                }
+                snprintf(name, sizeof(name), "%s.", inetFmt(croute->group, s1));
+                strcat(name, inetFmt(croute->originAddrs[i], s2));
+                statsLine(fp, "sg.%s.pkts %lu", name, croute->count[i].pktCnt);
+                statsLine(fp, "sg.%s.bytes %lu", name, croute->count[i].byteCnt);
+                statsLine(fp, "sg.%s.pktrate %lu", name, croute->count[i].pktRate);
+                statsLine(fp, "sg.%s.byterate %lu", name, croute->count[i].byteRate);
+            }
+        }
+    }
+}
+
+/**
+*   Compares two routes by group address, for ordered dumps of the table.
+*/
+static int routeCompare(const void *a, const void *b) {
+    uint32_t ga = ntohl((*(struct RouteTable * const *)a)->group);
+    uint32_t gb = ntohl((*(struct RouteTable * const *)b)->group);
+
+    return ga < gb ? -1 : ga > gb;
+}
+
+/**
+*   Returns a newly allocated array with all routes ordered by group,
+*   or NULL if the table is empty. The caller must free the array.
+*/
+static struct RouteTable **sortedRoutes(void) {
+    struct RouteTable   **routes, *croute;
+    unsigned            i = 0;
+
+    if (route_hash.count == 0) {
+        return NULL;
+    }
+
+    routes = (struct RouteTable **)malloc(route_hash.count * sizeof(struct RouteTable *));
+    if (routes == NULL) {
+        my_log(LOG_ERR, 0, "Out of memory.");
+    }
+    for (croute = routing_table; croute; croute = croute->nextroute) {
+        routes[i++] = croute;
+    }
+    qsort(routes, route_hash.count, sizeof(struct RouteTable *), routeCompare);
+
+    return routes;
 }
 
 /**
@@ -772,54 +1506,61 @@ int internUpdateKernelRoute(struct RouteTable *route, int activate) {
 */
 void logRouteTable(const char *header) {
         struct Config       *conf = getCommonConfig();
-        struct RouteTable   *croute = routing_table;
-        unsigned            rcount = 0;
+        struct RouteTable   **routes, *croute;
+        unsigned            rcount;
+
+        // Formatting the whole table is expensive, skip it unless it is logged.
+        if (LogLevel < LOG_DEBUG) {
+            return;
+        }
 
         my_log(LOG_DEBUG, 0, "");
         my_log(LOG_DEBUG, 0, "Current routing table (%s):", header);
         my_log(LOG_DEBUG, 0, "-----------------------------------------------------");
-        if(croute==NULL) {
+        routes = sortedRoutes();
+        if(routes==NULL) {
             my_log(LOG_DEBUG, 0, "No routes in table...");
         } else {
-            do {
+            for (rcount = 0; rcount < route_hash.count; rcount++) {
                 char st = 'I';
-                char src[MAX_ORIGINS * 30 + 1];
+                char src[(MAX_ORIGINS + 1) * 50 + 1];
                 src[0] = '\0';
                 int i;
 
+                croute = routes[rcount];
                 for (i = 0; i < MAX_ORIGINS; i++) {
                     if (croute->originAddrs[i] == 0) {
                         continue;
                     }
                     st = 'A';
-                    sprintf(src + strlen(src), "Src%d: %s, ", i, inetFmt(croute->originAddrs[i], s1));
+                    if (conf->sourceIdle) {
+                        sprintf(src + strlen(src), "Src%d: %s (%lu pps), ", i,
+                            inetFmt(croute->originAddrs[i], s1), croute->count[i].pktRate);
+                    } else {
+                        sprintf(src + strlen(src), "Src%d: %s, ", i, inetFmt(croute->originAddrs[i], s1));
+                    }
+                }
+                if (croute->anyMfc.inVif != -1) {
+                    st = 'A';
+                    strcat(src, "Src: *, ");
                 }
 
-                my_log(LOG_DEBUG, 0, "#%d: %sDst: %s, Age:%d, St: %c, OutVifs: 0x%08x, dHosts: %s",
-                    rcount, src, inetFmt(croute->group, s2),
-                    croute->ageValue, st,
-                    croute->vifBits,
-                    !conf->fastUpstreamLeave ? "not tracked" : testNoDownstreamHost(conf, croute) ? "no" : "yes");
-
-                croute = croute->nextroute;
-
-                rcount++;
-            } while ( croute != NULL );
+                if (conf->fastUpstreamLeave) {
+                    my_log(LOG_DEBUG, 0, "#%d: %sDst: %s, Age:%d, St: %c, OutVifs: 0x%08x, dHosts: %u",
+                        rcount, src, inetFmt(croute->group, s2),
+                        croute->ageValue, st,
+                        croute->vifBits,
+                        croute->hosts.count);
+                } else {
+                    my_log(LOG_DEBUG, 0, "#%d: %sDst: %s, Age:%d, St: %c, OutVifs: 0x%08x, dHosts: not tracked",
+                        rcount, src, inetFmt(croute->group, s2),
+                        croute->ageValue, st,
+                        croute->vifBits);
+                }
+            }
+            free(routes);
         }
 
         my_log(LOG_DEBUG, 0, "-----------------------------------------------------");
 }
 
-/**
-*   Returns true when the given group belongs to the given interface
-*/
-int interfaceInRoute(int32_t group, int Ix) {
-    struct RouteTable*  croute;
-    croute = findRoute(group);
-    if (croute != NULL) {
-        my_log(LOG_DEBUG, 0, "Interface id %d is in group %d", Ix, group);
-        return BIT_TST(croute->vifBits, Ix);
-    } else {
-        return 0;
-    }
-}
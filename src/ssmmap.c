@@ -0,0 +1,148 @@
+/*
+**  igmpproxy - IGMP proxy based multicast router
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+/**
+*   ssmmap.c - Static SSM mapping of groups to sources.
+*
+*   Hosts that only speak IGMPv1 or v2 can not tell the sources they
+*   want. The config file may map group prefixes to lists of sources,
+*   and reports for a mapped group then ask for those sources, as if the
+*   host had sent an IGMPv3 INCLUDE record. The prefixes are kept in a
+*   binary trie, so a group is looked up in at most 32 steps, however
+*   many mappings there are. The longest matching prefix wins.
+*/
+
+#include "igmpproxy.h"
+
+struct SsmMapNode {
+    unsigned            child[2];       // Node indexes, 0 if none.
+    unsigned            first;          // First source in SsmMapSources.
+    unsigned            count;          // Sources of the prefix, 0 if none.
+};
+
+static struct SsmMapNode *SsmMapTrie = NULL;
+static unsigned SsmMapTrieSize = 0, SsmMapTrieCount = 0;
+
+static struct in_addr *SsmMapSources = NULL;
+static unsigned SsmMapSourcesSize = 0, SsmMapSourcesCount = 0;
+
+/**
+*   Returns the trie node for the prefix 'addr'/'len', addr in host order.
+*/
+static struct SsmMapNode *addSsmMapNode(uint32_t addr, int len) {
+    unsigned n = 0, bit;
+    int i;
+
+    if (SsmMapTrie == NULL) {
+        SsmMapTrieSize = 32;
+        SsmMapTrie = calloc(SsmMapTrieSize, sizeof(*SsmMapTrie));
+        if (SsmMapTrie == NULL)
+            my_log(LOG_ERR, 0, "Out of memory !");
+        SsmMapTrieCount = 1;
+    }
+
+    for (i = 0; i < len; i++) {
+        bit = (addr >> (31 - i)) & 1;
+        if (SsmMapTrie[n].child[bit] == 0) {
+            if (SsmMapTrieCount == SsmMapTrieSize) {
+                struct SsmMapNode *trie;
+
+                trie = realloc(SsmMapTrie, 2 * SsmMapTrieSize * sizeof(*trie));
+                if (trie == NULL)
+                    my_log(LOG_ERR, 0, "Out of memory !");
+                SsmMapTrie = trie;
+                SsmMapTrieSize *= 2;
+            }
+            memset(&SsmMapTrie[SsmMapTrieCount], 0, sizeof(*SsmMapTrie));
+            SsmMapTrie[n].child[bit] = SsmMapTrieCount++;
+        }
+        n = SsmMapTrie[n].child[bit];
+    }
+    return &SsmMapTrie[n];
+}
+
+/**
+*   Maps the groups of the prefix 'sn' to the 'nsrcs' sources. A prefix
+*   mapped before gets the new sources.
+*/
+void addSsmMap(struct SubnetList *sn, int nsrcs, const struct in_addr *sources) {
+    struct SsmMapNode *node;
+    uint32_t mask = ntohl(sn->subnet_mask);
+    int len = 0;
+
+    while (len < 32 && (mask & (0x80000000u >> len)) != 0) {
+        len++;
+    }
+
+    if (SsmMapSourcesCount + nsrcs > SsmMapSourcesSize) {
+        struct in_addr *srcs;
+        unsigned size = SsmMapSourcesSize ? SsmMapSourcesSize : 16;
+
+        while (size < SsmMapSourcesCount + nsrcs) {
+            size *= 2;
+        }
+        srcs = realloc(SsmMapSources, size * sizeof(*srcs));
+        if (srcs == NULL)
+            my_log(LOG_ERR, 0, "Out of memory !");
+        SsmMapSources = srcs;
+        SsmMapSourcesSize = size;
+    }
+
+    node = addSsmMapNode(ntohl(sn->subnet_addr) & mask, len);
+    if (node->count > 0) {
+        my_log(LOG_WARNING, 0, "Config: SSM mapping of %s replaced.",
+            inetFmts(sn->subnet_addr, sn->subnet_mask, s1));
+    }
+    node->first = SsmMapSourcesCount;
+    node->count = nsrcs;
+    memcpy(&SsmMapSources[SsmMapSourcesCount], sources, nsrcs * sizeof(*sources));
+    SsmMapSourcesCount += nsrcs;
+}
+
+/**
+*   Returns the number of sources 'group' is mapped to, and sets 'sources'
+*   to them. Returns 0 if the group is not mapped.
+*/
+int lookupSsmMap(uint32_t group, const struct in_addr **sources) {
+    const struct SsmMapNode *node, *match = NULL;
+    uint32_t addr = ntohl(group);
+    unsigned n;
+    int i;
+
+    if (SsmMapTrie == NULL) {
+        return 0;
+    }
+
+    // Follow the bits of the group, and keep the longest mapped prefix.
+    node = &SsmMapTrie[0];
+    for (i = 0; ; i++) {
+        if (node->count > 0) {
+            match = node;
+        }
+        if (i == 32 || (n = node->child[(addr >> (31 - i)) & 1]) == 0) {
+            break;
+        }
+        node = &SsmMapTrie[n];
+    }
+    if (match == NULL) {
+        return 0;
+    }
+    *sources = &SsmMapSources[match->first];
+    return match->count;
+}
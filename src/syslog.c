@@ -61,3 +61,22 @@ void my_log( int Severity, int Errno, const char *FmtSt, ... )
     if( Severity <= LOG_ERR )
         exit( -1 );
 }
+
+/*
+ * Writes one line of statistics to the stream 'fp', or to the
+ * log if 'fp' is NULL.
+ */
+void statsLine( FILE *fp, const char *FmtSt, ... )
+{
+    char Line[ 128 ];
+
+    va_list ArgPt;
+    va_start( ArgPt, FmtSt );
+    vsnprintf( Line, sizeof( Line ), FmtSt, ArgPt );
+    va_end( ArgPt );
+
+    if (fp)
+        fprintf(fp, "%s\n", Line);
+    else
+        my_log(LOG_NOTICE, 0, "%s", Line);
+}